@@ -1,4 +1,3 @@
-import json
 import slurm
 import traceback
 
@@ -10,7 +9,7 @@ ERROR = "[ERROR]"
 
 def job_submit(job_desc, submit_uid):
     try:
-        slurm.user_msg(json.dumps(job_desc))
+        slurm.user_msg(slurm.to_json(job_desc))
         msg = f"{INFO} Job submitted by {submit_uid}."
         slurm.user_msg(msg)
         slurm.info(msg)
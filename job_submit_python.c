@@ -26,17 +26,52 @@
 #include <slurm.h>
 #include <slurm_errno.h>
 
+#include "src/common/assoc_mgr.h"
+#include "src/common/hostlist.h"
 #include "src/common/read_config.h"
 #include "src/common/xstring.h"
 #include "src/common/xmalloc.h"
+#include "src/slurmctld/locks.h"
 #include "src/slurmctld/slurmctld.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17, 11, 0)
 #define NO_VAL8 (0xfe)
 #endif
 
+// hostlist_t stopped being a pointer typedef in 23.11
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(23, 11, 0)
+typedef hostlist_t *hostlist_ref_t;
+typedef hostlist_iterator_t *hostlist_iterator_ref_t;
+#else
+typedef hostlist_t hostlist_ref_t;
+typedef hostlist_iterator_t hostlist_iterator_ref_t;
+#endif
+
+// The controller's configuration, read with the config read lock held
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(20, 11, 0)
+#define controller_conf slurm_conf
+#else
+#define controller_conf slurmctld_conf
+#endif
+
 const char plugin_name[] = "Job submit Python plugin";
 const char plugin_type[] = "job_submit/python";
 const uint32_t plugin_version = SLURM_VERSION_NUMBER;
@@ -45,6 +80,284 @@ static char *user_msg = NULL;
 
 static pthread_mutex_t python_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Optional plugin settings, read from ``job_submit_python.conf`` next to the
+ * Python script when the plugin is loaded
+ */
+#define CONFIG_FILE DEFAULT_SCRIPT_DIR "/job_submit_python.conf"
+
+#define SHED_POLICY_ACCEPT 0
+#define SHED_POLICY_REJECT 1
+
+static uint32_t shed_queue_depth = 0; // 0 disables load shedding
+static int shed_policy = SHED_POLICY_REJECT;
+
+static char *audit_file = NULL; // NULL disables the audit log
+static uint64_t audit_max_size = 64 * 1024 * 1024;
+static uint32_t audit_keep = 4;
+static uint32_t audit_sync_interval = 1;
+
+static void audit_start(void);
+static void audit_stop(void);
+
+static char *shadow_script = NULL; // NULL disables shadow evaluation
+static uint32_t shadow_queue_depth = 16;
+
+static void shadow_start(void);
+static void shadow_stop(void);
+
+/*
+ * Policy modules picked by partition or account. Modules are only imported
+ * by the submissions routed to them.
+ */
+struct policy_routes
+{
+	struct
+	{
+		char *name;
+		char *script;
+	} *route;
+	size_t count;
+};
+
+static struct policy_routes partition_scripts = {NULL, 0};
+static struct policy_routes account_scripts = {NULL, 0};
+static char *default_script = NULL; // set to "job_submit" by init(), NULL accepts unrouted jobs
+
+static void add_policy_route(struct policy_routes *routes, const char *key, const char *value);
+static void free_policy_routes(struct policy_routes *routes);
+
+/*
+ * Counters reported by ``slurm.stats()``. They are updated with atomic
+ * builtins since most of them change outside of ``python_lock``.
+ */
+static uint32_t stat_queue_depth = 0;
+static uint32_t stat_queue_depth_max = 0;
+static uint64_t stat_submissions = 0;
+static uint64_t stat_shed_accepted = 0;
+static uint64_t stat_shed_rejected = 0;
+static uint64_t stat_audit_records = 0;
+static uint64_t stat_audit_dropped = 0;
+static uint64_t stat_shadow_evaluated = 0;
+static uint64_t stat_shadow_disagreed = 0;
+static uint64_t stat_shadow_dropped = 0;
+static uint64_t stat_live_latency_us = 0;	// of the submissions evaluated in shadow
+static uint64_t stat_shadow_latency_us = 0;
+
+/*
+ * Counters of each stage of the policy pipeline, by module name. They only
+ * change under ``python_lock``.
+ */
+struct stage_stats
+{
+	char *name;
+	uint64_t calls;
+	uint64_t rejected;
+	uint64_t stopped;
+	uint64_t time_us;
+	uint64_t time_max_us;
+};
+
+static struct stage_stats *stage_stats = NULL;
+static size_t stage_stats_count = 0;
+
+static void free_stage_stats(void);
+
+// Return value of a pipeline stage accepting the job without running the next ones
+#define POLICY_STOP 0x7fffffff
+
+/*
+ * The ``job_descriptor`` being evaluated, for values computed natively on
+ * demand. It is only set while ``job_submit()`` holds ``python_lock``, and
+ * the generation lets objects created for one submission detect that they
+ * are used after it has been decided.
+ */
+static struct job_descriptor *current_job_desc = NULL;
+static uint64_t current_generation = 0;
+
+// ``slurm.JobDescriptor``, defined with the conversions of its fields
+static PyTypeObject *JobDescriptorType = NULL;
+static PyTypeObject *add_job_descriptor_type(PyObject *module);
+static void init_job_desc_index(void);
+static bool job_descriptor_script(PyObject *obj, const char **str, Py_ssize_t *len);
+static PyObject *py_slurm_to_json(PyObject *self, PyObject *args, PyObject *kwargs);
+static void json_buffer_free(void);
+
+/*
+ * A single request of a TRES string such as ``gres/gpu:a100:4``
+ */
+struct tres_request
+{
+	char *type;	 // "gres", "license", ... ("gres" when no prefix is given)
+	char *name;	 // "gpu"
+	char *model; // "a100", or NULL
+	uint64_t count;
+};
+
+/*
+ * Parsed TRES strings, keyed by the raw string. The entries are plain C data
+ * so they survive interpreter restarts.
+ */
+#define TRES_CACHE_SETS 16
+#define TRES_CACHE_WAYS 4
+
+struct tres_cache_entry
+{
+	uint32_t hash;
+	uint64_t last_used;
+	char *str;
+	int count;
+	struct tres_request *reqs;
+};
+
+static struct tres_cache_entry tres_cache[TRES_CACHE_SETS][TRES_CACHE_WAYS];
+static uint64_t tres_cache_clock = 0;
+
+/*
+ * Hashes of the script of the submission being evaluated, valid while the
+ * generation matches ``current_generation``
+ */
+static uint64_t script_hash_generation = 0;
+static uint64_t script_hash_value = 0;
+static uint64_t script_sha256_generation = 0;
+static char script_sha256_value[65];
+
+/*
+ * Options parsed from ``submit_line`` for the submission of the generation
+ */
+static uint64_t submit_options_generation = 0;
+static PyObject *submit_options = NULL;
+
+/*
+ * A compiled Aho-Corasick automaton over a set of byte patterns. Bytes are
+ * mapped to classes first: one per byte occurring in the patterns, folded
+ * with ``ignore_case``, and class 0 for all the others. ``delta`` is the
+ * complete transition table, ``classes`` entries per state; ``match`` is the
+ * pattern ending at a state or -1, and ``next_match`` links to the next
+ * state along the failure path with a match, 0 if there is none.
+ */
+struct pattern_set
+{
+	uint32_t hash;
+	bool ignore_case;
+	uint32_t count;
+	char **patterns;
+	uint16_t class_of[256];
+	uint32_t classes;
+	uint32_t states;
+	size_t bytes; // size of the tables
+	uint32_t *delta;
+	int32_t *match;
+	uint32_t *next_match;
+	uint64_t last_used;
+	struct pattern_set *next;
+};
+
+/*
+ * Compiled pattern sets, most recently used first. Python objects only
+ * borrow them, so the list is trimmed to PATTERN_CACHE_SIZE entries and
+ * PATTERN_CACHE_BYTES of tables once the interpreter is finalized, and
+ * recompiling at every policy load is avoided.
+ */
+#define PATTERN_CACHE_SIZE 8
+#define PATTERN_CACHE_BYTES (16 << 20)
+#define PATTERN_MAX_STATES 16384
+
+static struct pattern_set *pattern_cache = NULL;
+static uint64_t pattern_cache_clock = 0;
+
+/*
+ * Index of the controller's node table: the distinct features, GRES and
+ * partitions, and for every node bitsets of its features and partitions.
+ * It is rebuilt when ``last_node_update`` or ``last_part_update`` change.
+ */
+struct node_gres
+{
+	char *name;	 // "gpu"
+	char *model; // "a100", or NULL
+	uint64_t count;
+};
+
+/*
+ * The totals ``slurm.node_inventory()`` reports for a partition, built on
+ * first use after each refresh
+ */
+struct node_summary
+{
+	bool valid;
+	int nodes;
+	uint32_t *feature_nodes; // feature_count
+	int gres_count;
+	char **gres_names; // both "gpu" and "gpu:a100"
+	uint64_t *gres_counts;
+};
+
+struct node_index
+{
+	bool valid;
+	time_t node_update;
+	time_t part_update;
+	int node_count;
+	int feature_count;
+	char **features;
+	uint32_t *feature_hashes;
+	int feature_words;
+	uint64_t *node_features; // node_count * feature_words
+	int partition_count;
+	char **partitions;
+	int partition_words;
+	uint64_t *node_partitions; // node_count * partition_words
+	int *gres_start;		   // node_count + 1 offsets into gres
+	struct node_gres *gres;
+	struct node_summary *summaries; // partition_count + 1, the last for all nodes
+};
+
+static struct node_index node_index;
+static uint64_t node_index_version = 0;
+
+/*
+ * A compiled constraint expression such as ``a100&(ib|roce)``, as a postfix
+ * program over the feature names it mentions. The feature ids are resolved
+ * against the node index once per index version.
+ */
+enum constraint_opcode
+{
+	CONSTRAINT_FEATURE,
+	CONSTRAINT_AND,
+	CONSTRAINT_OR,
+	CONSTRAINT_NOT
+};
+
+struct constraint_op
+{
+	enum constraint_opcode opcode;
+	int name; // for CONSTRAINT_FEATURE
+};
+
+struct constraint
+{
+	uint32_t hash;
+	char *str;
+	uint64_t last_used;
+	int op_count;
+	struct constraint_op *ops;
+	int name_count;
+	char **names;
+	uint32_t min_nodes; // the largest ``feature*N`` count
+	uint64_t resolved_version;
+	int *feature_ids; // -1 if no node has the feature
+};
+
+/*
+ * Compiled constraints, least recently used replaced first. The parser
+ * recurses on each ``(``, ``[`` and ``!``, so nesting is bounded.
+ */
+#define CONSTRAINT_CACHE_SIZE 32
+#define CONSTRAINT_MAX_DEPTH 64
+
+static struct constraint constraint_cache[CONSTRAINT_CACHE_SIZE];
+static uint64_t constraint_cache_clock = 0;
+
 /*
  * Function to register into Python namespace to allow the plugin writer to
  * return information to the user running sbatch.
@@ -92,829 +405,5726 @@ static PyObject *py_slurm_error(PyObject *self, PyObject *arg)
 }
 
 /*
- * Register table of Python function name to C function
- */
-static PyMethodDef SlurmMethods[] = {
-		{"user_msg", py_slurm_user_msg, METH_O, ""},
-		{"info", py_slurm_info, METH_O, ""},
-		{"error", py_slurm_error, METH_O, ""},
-		{NULL, NULL, 0, NULL}};
-
-/*
- * Define the ``slurm`` module with the registered functions
- */
-static PyModuleDef SlurmModule = {
-		PyModuleDef_HEAD_INIT, "slurm", NULL, -1, SlurmMethods, NULL, NULL, NULL, NULL};
-
-/*
- * Create the ``slurm`` module
+ * Function to register into Python namespace to allow the plugin writer to
+ * inspect the plugin's counters
  */
-static PyObject *PyInit_slurm()
+static PyObject *py_slurm_stats(PyObject *self, PyObject *args)
 {
-	return PyModule_Create(&SlurmModule);
+	PyObject *stages = PyDict_New();
+	if (stages == NULL)
+		return NULL;
+	for (size_t i = 0; i < stage_stats_count; ++i)
+	{
+		const struct stage_stats *stage = &stage_stats[i];
+		PyObject *value = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K}",
+				"calls", (unsigned long long)stage->calls,
+				"rejected", (unsigned long long)stage->rejected,
+				"stopped", (unsigned long long)stage->stopped,
+				"time_us", (unsigned long long)stage->time_us,
+				"time_max_us", (unsigned long long)stage->time_max_us);
+		if (value == NULL || PyDict_SetItemString(stages, stage->name, value) < 0)
+		{
+			Py_XDECREF(value);
+			Py_DECREF(stages);
+			return NULL;
+		}
+		Py_DECREF(value);
+	}
+
+	return Py_BuildValue("{s:I,s:I,s:I,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N}",
+			"queue_depth", __atomic_load_n(&stat_queue_depth, __ATOMIC_RELAXED),
+			"queue_depth_max", __atomic_load_n(&stat_queue_depth_max, __ATOMIC_RELAXED),
+			"shed_queue_depth", shed_queue_depth,
+			"submissions", (unsigned long long)__atomic_load_n(&stat_submissions, __ATOMIC_RELAXED),
+			"shed_accepted", (unsigned long long)__atomic_load_n(&stat_shed_accepted, __ATOMIC_RELAXED),
+			"shed_rejected", (unsigned long long)__atomic_load_n(&stat_shed_rejected, __ATOMIC_RELAXED),
+			"audit_records", (unsigned long long)__atomic_load_n(&stat_audit_records, __ATOMIC_RELAXED),
+			"audit_dropped", (unsigned long long)__atomic_load_n(&stat_audit_dropped, __ATOMIC_RELAXED),
+			"shadow_evaluated", (unsigned long long)__atomic_load_n(&stat_shadow_evaluated, __ATOMIC_RELAXED),
+			"shadow_disagreed", (unsigned long long)__atomic_load_n(&stat_shadow_disagreed, __ATOMIC_RELAXED),
+			"shadow_dropped", (unsigned long long)__atomic_load_n(&stat_shadow_dropped, __ATOMIC_RELAXED),
+			"live_latency_us", (unsigned long long)__atomic_load_n(&stat_live_latency_us, __ATOMIC_RELAXED),
+			"shadow_latency_us", (unsigned long long)__atomic_load_n(&stat_shadow_latency_us, __ATOMIC_RELAXED),
+			"stages", stages);
 }
 
 /*
- * The plugin's entry point
+ * ``slurm.Hostlist``, a parsed Slurm host list such as ``gpu[001-128]``.
+ * Host names are only expanded when iterated or indexed.
  */
-int py_init(void)
+typedef struct
 {
-#ifdef DEBUG
-	info("[py_init] pid=%ld\n", syscall(__NR_gettid));
-#endif
+	PyObject_HEAD
+	hostlist_ref_t hl;
+} HostlistObject;
 
-	// Create the slurm module and put it in the path
-	PyImport_AppendInittab("slurm", &PyInit_slurm);
-	Py_Initialize();
+typedef struct
+{
+	PyObject_HEAD
+	PyObject *owner;
+	hostlist_iterator_ref_t itr;
+} HostlistIterObject;
 
-	// Append the script directory to the Python path
-	PyObject *sysPath = PySys_GetObject((char *)"path");
-	PyObject *script_path = PyUnicode_FromString(DEFAULT_SCRIPT_DIR);
-	PyList_Append(sysPath, script_path);
-	Py_DECREF(script_path);
-#ifdef DEBUG
-	info("[py_init] RETURN");
-#endif
+// Created for each interpreter by ``PyInit_slurm()``
+static PyTypeObject *HostlistType = NULL;
+static PyTypeObject *HostlistIterType = NULL;
 
-	return SLURM_SUCCESS;
+static void hostlist_dealloc(HostlistObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	if (self->hl)
+		hostlist_destroy(self->hl);
+	type->tp_free(self);
+	Py_DECREF(type);
 }
 
-int init(void)
+static Py_ssize_t hostlist_length(HostlistObject *self)
 {
-#ifdef DEBUG
-	info("[init] pid=%ld\n", syscall(__NR_gettid));
-#endif
-	slurm_mutex_init(&python_lock);
+	return hostlist_count(self->hl);
+}
 
-	return SLURM_SUCCESS;
+static int hostlist_contains(HostlistObject *self, PyObject *name)
+{
+	const char *s = PyUnicode_AsUTF8(name);
+	if (s == NULL)
+		return -1;
+	return hostlist_find(self->hl, s) >= 0;
 }
 
-/*
- * The plugin's cleanup function
- */
-int py_fini(void)
+static PyObject *hostlist_item(HostlistObject *self, Py_ssize_t i)
 {
-#ifdef DEBUG
-	info("[py_fini] pid=%ld\n", syscall(__NR_gettid));
-#endif
-	Py_FinalizeEx();
-	return SLURM_SUCCESS;
+	char *name = NULL;
+	if (i >= 0 && i < hostlist_count(self->hl))
+		name = hostlist_nth(self->hl, i);
+	if (name == NULL)
+	{
+		PyErr_SetString(PyExc_IndexError, "hostlist index out of range");
+		return NULL;
+	}
+	PyObject *obj = PyUnicode_FromString(name);
+	free(name);
+	return obj;
 }
 
-int fini(void)
+static PyObject *hostlist_str(HostlistObject *self)
 {
-#ifdef DEBUG
-	info("[fini] pid=%ld\n", syscall(__NR_gettid));
-#endif
-	return SLURM_SUCCESS;
+	char *ranged = hostlist_ranged_string_xmalloc(self->hl);
+	PyObject *obj = PyUnicode_FromString(ranged);
+	xfree(ranged);
+	return obj;
 }
 
-/*
- * If a Python error has occurred then print it and a traceback to the Slurm log
- */
-void print_python_error()
+static PyObject *hostlist_repr(HostlistObject *self)
 {
-	if (PyErr_Occurred())
-	{
-		PyObject *ptype, *pvalue, *ptraceback;
-		PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-		// PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+	char *ranged = hostlist_ranged_string_xmalloc(self->hl);
+	PyObject *obj = PyUnicode_FromFormat("slurm.Hostlist('%s')", ranged);
+	xfree(ranged);
+	return obj;
+}
 
-		// Import the ``traceback`` module
-		PyObject *pTracebackModuleName = PyUnicode_FromString("traceback");
-		PyObject *pTracebackModule = PyImport_Import(pTracebackModuleName);
-		Py_DECREF(pTracebackModuleName);
+static PyObject *hostlist_iter(HostlistObject *self)
+{
+	HostlistIterObject *it = PyObject_New(HostlistIterObject, HostlistIterType);
+	if (it == NULL)
+		return NULL;
+	Py_INCREF(self);
+	it->owner = (PyObject *)self;
+	it->itr = hostlist_iterator_create(self->hl);
+	return (PyObject *)it;
+}
 
-		// Get the ``traceback.format_tb`` function
-		PyObject *pFormatTbFn = PyObject_GetAttrString(pTracebackModule, "format_tb");
-		Py_DECREF(pTracebackModule);
+static void hostlist_iter_dealloc(HostlistIterObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	hostlist_iterator_destroy(self->itr);
+	Py_DECREF(self->owner);
+	PyObject_Free(self);
+	Py_DECREF(type);
+}
 
-		// Get the formatted traceback
-		PyObject *pFormattedTb = PyObject_CallFunctionObjArgs(pFormatTbFn, ptraceback, NULL);
-		Py_DECREF(pFormatTbFn);
-		Py_XDECREF(ptraceback);
+static PyObject *hostlist_iter_next(HostlistIterObject *self)
+{
+	char *name = hostlist_next(self->itr);
+	if (name == NULL)
+		return NULL;
+	PyObject *obj = PyUnicode_FromString(name);
+	free(name);
+	return obj;
+}
 
-		PyObject *pFormattedTbStr = PyObject_Str(pFormattedTb);
+static PyType_Slot HostlistSlots[] = {
+		{Py_tp_dealloc, hostlist_dealloc},
+		{Py_tp_iter, hostlist_iter},
+		{Py_tp_str, hostlist_str},
+		{Py_tp_repr, hostlist_repr},
+		{Py_sq_length, hostlist_length},
+		{Py_sq_contains, hostlist_contains},
+		{Py_sq_item, hostlist_item},
+		{0, NULL}};
 
-		error("job_submit/python: %s", PyUnicode_AsUTF8(pFormattedTbStr));
-		error("job_submit/python: %s: %s", PyUnicode_AsUTF8(ptype), PyUnicode_AsUTF8(pvalue));
+static PyType_Spec HostlistSpec = {
+		"slurm.Hostlist", sizeof(HostlistObject), 0, Py_TPFLAGS_DEFAULT, HostlistSlots};
 
-		Py_DECREF(pFormattedTbStr);
-		Py_XDECREF(pvalue);
-		Py_DECREF(ptype);
+static PyType_Slot HostlistIterSlots[] = {
+		{Py_tp_dealloc, hostlist_iter_dealloc},
+		{Py_tp_iter, PyObject_SelfIter},
+		{Py_tp_iternext, hostlist_iter_next},
+		{0, NULL}};
 
-		PyErr_Clear();
-	}
-}
+static PyType_Spec HostlistIterSpec = {
+		"slurm.HostlistIterator", sizeof(HostlistIterObject), 0, Py_TPFLAGS_DEFAULT, HostlistIterSlots};
 
 /*
- * Insert ``obj`` into ``dict`` with key ``name``
+ * Wrap ``hl`` in a ``slurm.Hostlist``, taking ownership of it
  */
-void insert_object(PyObject *dict, char *name, PyObject *obj)
+static PyObject *hostlist_to_python(hostlist_ref_t hl)
 {
-	if (obj != NULL)
-	{
-		PyDict_SetItemString(dict, name, obj);
-		Py_DECREF(obj);
-	}
-	else
+	HostlistObject *obj = PyObject_New(HostlistObject, HostlistType);
+	if (obj == NULL)
 	{
-		error("job_submit/python: Could not convert job description entry %s", name);
-		print_python_error();
+		hostlist_destroy(hl);
+		return NULL;
 	}
+	obj->hl = hl;
+	return (PyObject *)obj;
 }
 
 /*
- * Turn a ``char**`` into a list of strings
+ * Return a new host list parsed from a string, copied from a
+ * ``slurm.Hostlist`` or empty for ``None``
  */
-PyObject *char_star_star_to_python(uint32_t num_strings, char **str_list)
+static hostlist_ref_t hostlist_from_python(PyObject *obj)
 {
-	PyObject *list = PyList_New(num_strings);
-
-	for (int i = 0; i < num_strings; ++i)
-	{
-		PyObject *str = PyUnicode_FromString(str_list[i]);
-		PyList_SetItem(list, i, str);
-	}
+	if (obj == Py_None)
+		return hostlist_create(NULL);
+	if (Py_TYPE(obj) == HostlistType)
+		return hostlist_copy(((HostlistObject *)obj)->hl);
 
-	return list;
+	const char *s = PyUnicode_AsUTF8(obj);
+	if (s == NULL)
+		return NULL;
+	hostlist_ref_t hl = hostlist_create(s);
+	if (hl == NULL)
+		PyErr_Format(PyExc_ValueError, "invalid host list \"%s\"", s);
+	return hl;
 }
 
 /*
- * Turn a list of ``a=b`` strings into a dict
+ * Function to register into Python namespace to expand a host list lazily
  */
-PyObject *char_star_star_to_python_dict(uint32_t num_strings, char **str_list)
+static PyObject *py_slurm_hostlist_expand(PyObject *self, PyObject *arg)
 {
-	PyObject *dict = PyDict_New();
+	hostlist_ref_t hl = hostlist_from_python(arg);
+	if (hl == NULL)
+		return NULL;
+	return hostlist_to_python(hl);
+}
 
-	for (int i = 0; i < num_strings; ++i)
-	{
-		char *eq = xstrchr(str_list[i], '=');
-		size_t eq_position = (size_t)(eq - str_list[i]);
-		PyObject *str_val = PyUnicode_FromString(str_list[i] + eq_position + 1);
-		PyDict_SetItemString(dict, xstrndup(str_list[i], eq_position), str_val);
-	}
+/*
+ * Function to register into Python namespace to count the hosts of a host list
+ */
+static PyObject *py_slurm_hostlist_count(PyObject *self, PyObject *arg)
+{
+	if (Py_TYPE(arg) == HostlistType)
+		return PyLong_FromLong(hostlist_count(((HostlistObject *)arg)->hl));
 
-	return dict;
+	hostlist_ref_t hl = hostlist_from_python(arg);
+	if (hl == NULL)
+		return NULL;
+	PyObject *count = PyLong_FromLong(hostlist_count(hl));
+	hostlist_destroy(hl);
+	return count;
 }
 
-#define insert_char_star(job_desc, dict, name)                          \
-	do                                                                    \
-	{                                                                     \
-		if (job_desc->name != NULL)                                         \
-			insert_object(dict, #name, PyUnicode_FromString(job_desc->name)); \
-		else                                                                \
-		{                                                                   \
-			insert_object(dict, #name, Py_None);                              \
-			Py_INCREF(Py_None);                                               \
-		}                                                                   \
-	} while (0)
-#define insert_char_star_star(job_desc, dict, name, count)                                   \
-	do                                                                                         \
-	{                                                                                          \
-		if (job_desc->name != NULL)                                                              \
-			insert_object(dict, #name, char_star_star_to_python(job_desc->count, job_desc->name)); \
-		else                                                                                     \
-		{                                                                                        \
-			insert_object(dict, #name, Py_None);                                                   \
-			Py_INCREF(Py_None);                                                                    \
-		}                                                                                        \
-	} while (0)
-#define insert_environment_dict(job_desc, dict, name, count)                                      \
-	do                                                                                              \
-	{                                                                                               \
-		if (job_desc->name != NULL)                                                                   \
-			insert_object(dict, #name, char_star_star_to_python_dict(job_desc->count, job_desc->name)); \
-		else                                                                                          \
-		{                                                                                             \
-			insert_object(dict, #name, Py_None);                                                        \
-			Py_INCREF(Py_None);                                                                         \
-		}                                                                                             \
-	} while (0)
-#define insert_uint8_t(job_desc, dict, name)                               \
-	do                                                                       \
-	{                                                                        \
-		if (job_desc->name != NO_VAL8)                                         \
-			insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); \
-		else                                                                   \
-			insert_object(dict, #name, Py_None);                                 \
-	} while (0)
-#define insert_uint16_t(job_desc, dict, name)                              \
-	do                                                                       \
-	{                                                                        \
-		if (job_desc->name != NO_VAL16)                                        \
-			insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); \
-		else                                                                   \
-			insert_object(dict, #name, Py_None);                                 \
-	} while (0)
-#define insert_uint32_t(job_desc, dict, name)                              \
-	do                                                                       \
-	{                                                                        \
-		if (job_desc->name != NO_VAL)                                          \
-			insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); \
-		else                                                                   \
-			insert_object(dict, #name, Py_None);                                 \
-	} while (0)
-#define insert_uint64_t(job_desc, dict, name)                                  \
-	do                                                                           \
-	{                                                                            \
-		if (job_desc->name != NO_VAL64)                                            \
-			insert_object(dict, #name, PyLong_FromUnsignedLongLong(job_desc->name)); \
-		else                                                                       \
-			insert_object(dict, #name, Py_None);                                     \
-	} while (0)
-#define insert_time_t(job_desc, dict, name)                              \
-	do                                                                     \
-	{                                                                      \
-		insert_object(dict, #name, PyLong_FromUnsignedLong(job_desc->name)); \
-	} while (0)
-#define insert_uint8_t_to_bool(job_desc, dict, name)               \
-	do                                                               \
-	{                                                                \
-		if (job_desc->name != NO_VAL8)                                 \
-		{                                                              \
-			insert_object(dict, #name, PyBool_FromLong(job_desc->name)); \
-		}                                                              \
-		else                                                           \
-			insert_object(dict, #name, Py_None);                         \
-	} while (0)
-#define insert_uint16_t_to_bool(job_desc, dict, name)              \
-	do                                                               \
-	{                                                                \
-		if (job_desc->name != NO_VAL16)                                \
-		{                                                              \
-			insert_object(dict, #name, PyBool_FromLong(job_desc->name)); \
-		}                                                              \
-		else                                                           \
-			insert_object(dict, #name, Py_None);                         \
-	} while (0)
-
-/*
- * Return a namespace object representing the ``job_descriptor`` struct
- */
-PyObject *create_job_desc_dict(struct job_descriptor *job_desc)
+/*
+ * Function to register into Python namespace to test whether a host belongs
+ * to a host list
+ */
+static PyObject *py_slurm_hostlist_contains(PyObject *self, PyObject *args)
 {
-#ifdef DEBUG
-	info("[create_job_desc_dict] %s", "ENTRY");
-#endif
-	PyObject *pJobDesc = PyDict_New();
-
-	insert_char_star(job_desc, pJobDesc, account);
-	insert_char_star(job_desc, pJobDesc, acctg_freq);
-	insert_char_star(job_desc, pJobDesc, admin_comment);
-	insert_char_star(job_desc, pJobDesc, alloc_node);
-	insert_uint16_t(job_desc, pJobDesc, alloc_resp_port);
-	insert_uint32_t(job_desc, pJobDesc, alloc_sid);
-	insert_char_star_star(job_desc, pJobDesc, argv, argc);
-	insert_char_star(job_desc, pJobDesc, array_inx);
-	insert_time_t(job_desc, pJobDesc, begin_time);
-	insert_uint32_t(job_desc, pJobDesc, bitflags);
-	insert_char_star(job_desc, pJobDesc, burst_buffer);
-	insert_char_star(job_desc, pJobDesc, clusters);
-	insert_char_star(job_desc, pJobDesc, comment);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, contiguous);
-	insert_uint16_t(job_desc, pJobDesc, core_spec);
-	insert_char_star(job_desc, pJobDesc, cpu_bind);
-	insert_uint16_t(job_desc, pJobDesc, cpu_bind_type);
-	insert_uint32_t(job_desc, pJobDesc, cpu_freq_min);
-	insert_uint32_t(job_desc, pJobDesc, cpu_freq_max);
-	insert_uint32_t(job_desc, pJobDesc, cpu_freq_gov);
-	insert_time_t(job_desc, pJobDesc, deadline);
-	insert_uint32_t(job_desc, pJobDesc, delay_boot);
-	insert_char_star(job_desc, pJobDesc, dependency);
-	insert_time_t(job_desc, pJobDesc, end_time);
-	insert_environment_dict(job_desc, pJobDesc, environment, env_size);
-	insert_char_star(job_desc, pJobDesc, exc_nodes);
-	insert_char_star(job_desc, pJobDesc, features);
-	insert_uint32_t(job_desc, pJobDesc, group_id);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, immediate);
-	insert_uint32_t(job_desc, pJobDesc, job_id);
-	insert_char_star(job_desc, pJobDesc, job_id_str);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, kill_on_node_fail);
-	insert_char_star(job_desc, pJobDesc, licenses);
-	insert_uint16_t(job_desc, pJobDesc, mail_type);
-	insert_char_star(job_desc, pJobDesc, mail_user);
-	insert_char_star(job_desc, pJobDesc, mcs_label);
-	insert_char_star(job_desc, pJobDesc, mem_bind);
-	insert_uint16_t(job_desc, pJobDesc, mem_bind_type);
-	insert_char_star(job_desc, pJobDesc, name);
-	insert_char_star(job_desc, pJobDesc, network);
-	insert_uint32_t(job_desc, pJobDesc, nice);
-	insert_uint32_t(job_desc, pJobDesc, num_tasks);
-	insert_uint8_t(job_desc, pJobDesc, open_mode);
-	insert_uint16_t(job_desc, pJobDesc, other_port);
-	insert_uint8_t_to_bool(job_desc, pJobDesc, overcommit);
-	insert_char_star(job_desc, pJobDesc, partition);
-	insert_uint16_t(job_desc, pJobDesc, plane_size);
-	insert_uint8_t(job_desc, pJobDesc, power_flags);
-	insert_uint32_t(job_desc, pJobDesc, priority);
-	insert_uint32_t(job_desc, pJobDesc, profile);
-	insert_char_star(job_desc, pJobDesc, qos);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, reboot);
-	insert_char_star(job_desc, pJobDesc, resp_host);
-	insert_uint16_t(job_desc, pJobDesc, restart_cnt);
-	insert_char_star(job_desc, pJobDesc, req_nodes);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, requeue);
-	insert_char_star(job_desc, pJobDesc, reservation);
-	insert_char_star(job_desc, pJobDesc, script);
-	insert_uint16_t(job_desc, pJobDesc, shared);
-	insert_char_star_star(job_desc, pJobDesc, spank_job_env, spank_job_env_size);
-	insert_uint32_t(job_desc, pJobDesc, task_dist);
-	insert_uint32_t(job_desc, pJobDesc, time_limit);
-	insert_uint32_t(job_desc, pJobDesc, time_min);
-	insert_uint32_t(job_desc, pJobDesc, user_id);
-	insert_uint16_t_to_bool(job_desc, pJobDesc, wait_all_nodes);
-	insert_uint16_t(job_desc, pJobDesc, warn_flags);
-	insert_uint16_t(job_desc, pJobDesc, warn_signal);
-	insert_uint16_t(job_desc, pJobDesc, warn_time);
-	insert_char_star(job_desc, pJobDesc, work_dir);
-	insert_uint16_t(job_desc, pJobDesc, cpus_per_task);
-	insert_uint32_t(job_desc, pJobDesc, min_cpus);
-	insert_uint32_t(job_desc, pJobDesc, max_cpus);
-	insert_uint32_t(job_desc, pJobDesc, min_nodes);
-	insert_uint32_t(job_desc, pJobDesc, max_nodes);
-	insert_uint16_t(job_desc, pJobDesc, boards_per_node);
-	insert_uint16_t(job_desc, pJobDesc, sockets_per_board);
-	insert_uint16_t(job_desc, pJobDesc, sockets_per_node);
-	insert_uint16_t(job_desc, pJobDesc, cores_per_socket);
-	insert_uint16_t(job_desc, pJobDesc, threads_per_core);
-	insert_uint16_t(job_desc, pJobDesc, ntasks_per_node);
-	insert_uint16_t(job_desc, pJobDesc, ntasks_per_socket);
-	insert_uint16_t(job_desc, pJobDesc, ntasks_per_core);
-	insert_uint16_t(job_desc, pJobDesc, ntasks_per_board);
-	insert_uint16_t(job_desc, pJobDesc, pn_min_cpus);
-	insert_uint64_t(job_desc, pJobDesc, pn_min_memory);
-	insert_uint32_t(job_desc, pJobDesc, pn_min_tmp_disk);
-	insert_uint32_t(job_desc, pJobDesc, req_switch);
-	insert_char_star(job_desc, pJobDesc, std_err);
-	insert_char_star(job_desc, pJobDesc, std_in);
-	insert_char_star(job_desc, pJobDesc, std_out);
-	insert_uint32_t(job_desc, pJobDesc, wait4switch);
-	insert_char_star(job_desc, pJobDesc, wckey);
+	PyObject *hosts;
+	const char *name;
+	if (!PyArg_ParseTuple(args, "Os:hostlist_contains", &hosts, &name))
+		return NULL;
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 2, 0) && SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17, 11, 0)
-	insert_uint64_t(job_desc, pJobDesc, fed_siblings);
-	insert_uint32_t(job_desc, pJobDesc, group_number);
-	insert_uint32_t(job_desc, pJobDesc, numpack);
-	insert_uint32_t(job_desc, pJobDesc, pack_leader);
-	insert_environment_dict(job_desc, pJobDesc, pelog_env, pelog_env_size);
-	insert_uint8_t(job_desc, pJobDesc, resv_port);
-#endif
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 11, 0)
-	insert_char_star(job_desc, pJobDesc, cluster_features);
-	insert_char_star(job_desc, pJobDesc, extra);
-	insert_uint64_t(job_desc, pJobDesc, fed_siblings_active);
-	insert_uint64_t(job_desc, pJobDesc, fed_siblings_viable);
-	insert_char_star(job_desc, pJobDesc, origin_cluster);
-	insert_uint16_t(job_desc, pJobDesc, x11);
-	insert_char_star(job_desc, pJobDesc, x11_magic_cookie);
-	insert_uint16_t(job_desc, pJobDesc, x11_target_port);
-#endif
+	if (Py_TYPE(hosts) == HostlistType)
+		return PyBool_FromLong(hostlist_find(((HostlistObject *)hosts)->hl, name) >= 0);
 
-#if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(18, 8, 0)
-	insert_char_star(job_desc, pJobDesc, gres);
-#endif
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
-	insert_char_star(job_desc, pJobDesc, batch_features);
-	insert_char_star(job_desc, pJobDesc, cpus_per_tres);
-	insert_char_star(job_desc, pJobDesc, mem_per_tres);
-	insert_char_star(job_desc, pJobDesc, tres_bind);
-	insert_char_star(job_desc, pJobDesc, tres_freq);
-	insert_char_star(job_desc, pJobDesc, tres_per_job);
-	insert_char_star(job_desc, pJobDesc, tres_per_node);
-	insert_char_star(job_desc, pJobDesc, tres_per_socket);
-	insert_char_star(job_desc, pJobDesc, tres_per_task);
-#endif
+	hostlist_ref_t hl = hostlist_from_python(hosts);
+	if (hl == NULL)
+		return NULL;
+	PyObject *found = PyBool_FromLong(hostlist_find(hl, name) >= 0);
+	hostlist_destroy(hl);
+	return found;
+}
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(19, 5, 0)
-	insert_uint32_t(job_desc, pJobDesc, site_factor);
-	insert_char_star(job_desc, pJobDesc, x11_target);
-#endif
+/*
+ * Function to register into Python namespace to return the hosts of the first
+ * host list that are also in the second, in the order of the first
+ */
+static PyObject *py_slurm_hostlist_intersect(PyObject *self, PyObject *args)
+{
+	PyObject *a, *b;
+	if (!PyArg_ParseTuple(args, "OO:hostlist_intersect", &a, &b))
+		return NULL;
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(21, 0, 0)
-	insert_char_star(job_desc, pJobDesc, submit_line);
-#endif
+	hostlist_ref_t hl_a = hostlist_from_python(a);
+	if (hl_a == NULL)
+		return NULL;
+	hostlist_ref_t hl_b = hostlist_from_python(b);
+	if (hl_b == NULL)
+	{
+		hostlist_destroy(hl_a);
+		return NULL;
+	}
 
-#ifdef DEBUG
-	info("[create_job_desc_dict] %s", "RETURN");
-#endif
-	return pJobDesc;
+	hostlist_ref_t result = hostlist_create(NULL);
+	hostlist_iterator_ref_t itr = hostlist_iterator_create(hl_a);
+	char *name;
+	while ((name = hostlist_next(itr)))
+	{
+		if (hostlist_find(hl_b, name) >= 0)
+			hostlist_push_host(result, name);
+		free(name);
+	}
+	hostlist_iterator_destroy(itr);
+	hostlist_destroy(hl_a);
+	hostlist_destroy(hl_b);
+
+	return hostlist_to_python(result);
 }
 
 /*
- * Free the memory associated with every string in a char* array and the array
- * itself.
+ * Return true if an object created for submission ``generation`` may still
+ * read ``current_job_desc``, raising RuntimeError otherwise
  */
-void clear_char_star_star(uint32_t *num_strings_p, char ***str_list_p)
+static bool check_generation(uint64_t generation)
 {
-	for (int i = 0; i < *num_strings_p; ++i)
+	if (generation != current_generation || current_job_desc == NULL)
 	{
-		xfree((*str_list_p)[i]);
+		PyErr_SetString(PyExc_RuntimeError, "job descriptor is no longer being evaluated");
+		return false;
 	}
-	xfree(*str_list_p);
-	*num_strings_p = 0;
+	return true;
 }
 
 /*
- * Given an array of strings, move any NULL strings to the end
+ * FNV-1a hash of a C string
  */
-void defragment_array(uint32_t num_strings, char **str_list)
+static uint32_t hash_string(const char *str)
 {
-	for (int empty_finder = 0; empty_finder < num_strings; ++empty_finder)
-	{
-		if (str_list[empty_finder] == NULL)
-		{
-			for (int back_pointer = num_strings - 1; back_pointer > empty_finder; --back_pointer)
-			{
-				if (str_list[back_pointer] != NULL)
-				{
-					str_list[empty_finder] = str_list[back_pointer];
-					str_list[back_pointer] = NULL;
-					break;
-				}
-			}
-		}
-	}
+	uint32_t hash = 2166136261u;
+	for (const char *p = str; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+	return hash;
 }
 
-void python_dict_to_environment(PyObject *obj, uint32_t *num_strings_p, char ***str_list_p)
+static void free_tres_requests(int count, struct tres_request *reqs)
 {
-	if (obj == Py_None)
+	for (int i = 0; i < count; ++i)
 	{
-		clear_char_star_star(num_strings_p, str_list_p);
-		return;
+		xfree(reqs[i].type);
+		xfree(reqs[i].name);
+		xfree(reqs[i].model);
+	}
+	xfree(reqs);
+}
+
+/*
+ * Parse a GRES/TRES count with an optional k, m, g, t or p suffix. Return
+ * false if ``str`` is not a count.
+ */
+static bool parse_tres_count(const char *str, size_t len, uint64_t *count)
+{
+	uint64_t value = 0;
+	size_t i = 0;
+
+	if (len == 0 || !isdigit((unsigned char)str[0]))
+		return false;
+	for (; i < len && isdigit((unsigned char)str[i]); ++i)
+		value = value * 10 + (str[i] - '0');
+
+	if (i + 1 == len)
+	{
+		const char *suffixes = "kmgtp";
+		const char *suffix = strchr(suffixes, tolower((unsigned char)str[i]));
+		if (suffix == NULL)
+			return false;
+		for (int shift = suffix - suffixes + 1; shift > 0; --shift)
+			value *= 1024;
+	}
+	else if (i != len)
+	{
+		return false;
+	}
+
+	*count = value;
+	return true;
+}
+
+/*
+ * Parse a comma separated TRES string such as ``gres/gpu:a100:4,license/foo``
+ * into ``*reqs``. Requests without a count count as 1, requests without a
+ * ``type/`` prefix are GRES as in older Slurm releases. Return the number of
+ * requests, or -1 if the string is malformed.
+ */
+static int parse_tres_string(const char *str, struct tres_request **reqs)
+{
+	int count = 0;
+	*reqs = NULL;
+
+	for (const char *token = str; *token;)
+	{
+		const char *end = strchr(token, ',');
+		size_t len = end ? (size_t)(end - token) : strlen(token);
+
+		if (len > 0)
+		{
+			xrealloc(*reqs, sizeof(struct tres_request) * (count + 1));
+			struct tres_request *req = &(*reqs)[count++];
+			memset(req, 0, sizeof(*req));
+			req->count = 1;
+
+			const char *slash = memchr(token, '/', len);
+			const char *name = token;
+			if (slash)
+			{
+				req->type = xstrndup(token, slash - token);
+				name = slash + 1;
+			}
+			else
+			{
+				req->type = xstrdup("gres");
+				// Some releases spell the prefix "gres:"
+				if (len > 5 && !strncmp(token, "gres:", 5))
+					name = token + 5;
+			}
+
+			const char *token_end = token + len;
+			const char *colon = memchr(name, ':', token_end - name);
+			req->name = xstrndup(name, (colon ? colon : token_end) - name);
+			if (req->name[0] == '\0')
+			{
+				free_tres_requests(count, *reqs);
+				*reqs = NULL;
+				return -1;
+			}
+
+			// The last field is the count if numeric, whatever precedes it the model
+			if (colon)
+			{
+				const char *last = colon + 1;
+				const char *next;
+				while ((next = memchr(last, ':', token_end - last)))
+					last = next + 1;
+				const char *model_end = token_end;
+				if (parse_tres_count(last, token_end - last, &req->count))
+					model_end = last - 1;
+				if (model_end > colon + 1)
+					req->model = xstrndup(colon + 1, model_end - colon - 1);
+			}
+		}
+
+		token = end ? end + 1 : token + len;
+	}
+
+	return count;
+}
+
+/*
+ * Return the parsed form of ``str`` from the cache, parsing it on a miss.
+ * The result belongs to the cache and stays valid until the next lookup.
+ */
+static int lookup_tres_string(const char *str, struct tres_request **reqs)
+{
+	uint32_t hash = hash_string(str);
+	struct tres_cache_entry *set = tres_cache[hash % TRES_CACHE_SETS];
+	struct tres_cache_entry *victim = &set[0];
+
+	for (int way = 0; way < TRES_CACHE_WAYS; ++way)
+	{
+		struct tres_cache_entry *entry = &set[way];
+		if (entry->str && entry->hash == hash && !strcmp(entry->str, str))
+		{
+			entry->last_used = ++tres_cache_clock;
+			*reqs = entry->reqs;
+			return entry->count;
+		}
+		if (entry->last_used < victim->last_used)
+			victim = entry;
+	}
+
+	struct tres_request *parsed;
+	int count = parse_tres_string(str, &parsed);
+	if (count < 0)
+		return -1;
+
+	xfree(victim->str);
+	free_tres_requests(victim->count, victim->reqs);
+	victim->hash = hash;
+	victim->str = xstrdup(str);
+	victim->count = count;
+	victim->reqs = parsed;
+	victim->last_used = ++tres_cache_clock;
+
+	*reqs = parsed;
+	return count;
+}
+
+static void tres_cache_flush(void)
+{
+	for (int set = 0; set < TRES_CACHE_SETS; ++set)
+	{
+		for (int way = 0; way < TRES_CACHE_WAYS; ++way)
+		{
+			struct tres_cache_entry *entry = &tres_cache[set][way];
+			xfree(entry->str);
+			free_tres_requests(entry->count, entry->reqs);
+			entry->reqs = NULL;
+			entry->count = 0;
+			entry->last_used = 0;
+		}
+	}
+}
+
+/*
+ * Return a list of ``{"type", "name", "model", "count"}`` dicts for a TRES
+ * string, or None for NULL
+ */
+static PyObject *tres_string_to_python(const char *str)
+{
+	if (str == NULL)
+		Py_RETURN_NONE;
+
+	struct tres_request *reqs;
+	int count = lookup_tres_string(str, &reqs);
+	if (count < 0)
+	{
+		PyErr_Format(PyExc_ValueError, "invalid TRES string \"%s\"", str);
+		return NULL;
+	}
+
+	PyObject *list = PyList_New(count);
+	if (list == NULL)
+		return NULL;
+	for (int i = 0; i < count; ++i)
+	{
+		PyObject *req = Py_BuildValue("{s:s,s:s,s:z,s:K}", "type", reqs[i].type, "name", reqs[i].name,
+									  "model", reqs[i].model, "count", (unsigned long long)reqs[i].count);
+		if (req == NULL)
+		{
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, req);
+	}
+	return list;
+}
+
+/*
+ * Function to register into Python namespace to parse a TRES string such as
+ * ``gres/gpu:a100:4``
+ */
+static PyObject *py_slurm_parse_tres(PyObject *self, PyObject *arg)
+{
+	if (arg == Py_None)
+		Py_RETURN_NONE;
+
+	const char *str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+	return tres_string_to_python(str);
+}
+
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
+/*
+ * ``slurm.TresView``, the ``tres`` entry of the job descriptor. Each TRES
+ * field of the submitted job is parsed the first time it is read.
+ */
+enum
+{
+	TRES_VIEW_PER_JOB,
+	TRES_VIEW_PER_NODE,
+	TRES_VIEW_PER_SOCKET,
+	TRES_VIEW_PER_TASK,
+	TRES_VIEW_CPUS_PER_TRES,
+	TRES_VIEW_MEM_PER_TRES,
+	TRES_VIEW_COUNT
+};
+
+typedef struct
+{
+	PyObject_HEAD
+	uint64_t generation;
+	PyObject *parsed[TRES_VIEW_COUNT];
+} TresViewObject;
+
+static PyTypeObject *TresViewType = NULL;
+
+static const size_t tres_view_offsets[TRES_VIEW_COUNT] = {
+		offsetof(struct job_descriptor, tres_per_job),
+		offsetof(struct job_descriptor, tres_per_node),
+		offsetof(struct job_descriptor, tres_per_socket),
+		offsetof(struct job_descriptor, tres_per_task),
+		offsetof(struct job_descriptor, cpus_per_tres),
+		offsetof(struct job_descriptor, mem_per_tres)};
+
+static void tres_view_dealloc(TresViewObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	for (int i = 0; i < TRES_VIEW_COUNT; ++i)
+		Py_XDECREF(self->parsed[i]);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyObject *tres_view_get(TresViewObject *self, void *closure)
+{
+	intptr_t field = (intptr_t)closure;
+
+	if (field < 0 || field >= TRES_VIEW_COUNT)
+	{
+		PyErr_BadInternalCall();
+		return NULL;
+	}
+
+	if (self->parsed[field] == NULL)
+	{
+		if (!check_generation(self->generation))
+			return NULL;
+
+		const char *str = *(char **)((char *)current_job_desc + tres_view_offsets[field]);
+		if ((self->parsed[field] = tres_string_to_python(str)) == NULL)
+			return NULL;
+	}
+
+	Py_INCREF(self->parsed[field]);
+	return self->parsed[field];
+}
+
+static PyGetSetDef TresViewGetSet[] = {
+		{"per_job", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_PER_JOB},
+		{"per_node", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_PER_NODE},
+		{"per_socket", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_PER_SOCKET},
+		{"per_task", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_PER_TASK},
+		{"cpus_per_tres", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_CPUS_PER_TRES},
+		{"mem_per_tres", (getter)tres_view_get, NULL, NULL, (void *)TRES_VIEW_MEM_PER_TRES},
+		{NULL}};
+
+static PyType_Slot TresViewSlots[] = {
+		{Py_tp_dealloc, tres_view_dealloc},
+		{Py_tp_getset, TresViewGetSet},
+		{0, NULL}};
+
+static PyType_Spec TresViewSpec = {
+		"slurm.TresView", sizeof(TresViewObject), 0, Py_TPFLAGS_DEFAULT, TresViewSlots};
+
+/*
+ * Return a new ``slurm.TresView`` for the submission being evaluated
+ */
+static PyObject *create_tres_view(void)
+{
+	TresViewObject *view = PyObject_New(TresViewObject, TresViewType);
+	if (view == NULL)
+		return NULL;
+	view->generation = current_generation;
+	memset(view->parsed, 0, sizeof(view->parsed));
+	return (PyObject *)view;
+}
+#endif
+
+/*
+ * Names of the bits of the packed flag fields of the job descriptor
+ */
+struct flag_name
+{
+	uint64_t flag;
+	const char *name;
+};
+
+#define FLAG_NAME(flag) {flag, #flag}
+
+// Spelled as for ``sbatch --mail-type``
+static const struct flag_name mail_type_names[] = {
+		{MAIL_JOB_BEGIN, "BEGIN"},
+		{MAIL_JOB_END, "END"},
+		{MAIL_JOB_FAIL, "FAIL"},
+		{MAIL_JOB_REQUEUE, "REQUEUE"},
+		{MAIL_JOB_TIME100, "TIME_LIMIT"},
+		{MAIL_JOB_TIME90, "TIME_LIMIT_90"},
+		{MAIL_JOB_TIME80, "TIME_LIMIT_80"},
+		{MAIL_JOB_TIME50, "TIME_LIMIT_50"},
+#ifdef MAIL_JOB_STAGE_OUT
+		{MAIL_JOB_STAGE_OUT, "STAGE_OUT"},
+#endif
+#ifdef MAIL_ARRAY_TASKS
+		{MAIL_ARRAY_TASKS, "ARRAY_TASKS"},
+#endif
+#ifdef MAIL_INVALID_DEPEND
+		{MAIL_INVALID_DEPEND, "INVALID_DEPEND"},
+#endif
+		{0, NULL}};
+
+// Spelled as for ``srun --cpu-bind``, only the 16 bits kept in the descriptor
+static const struct flag_name cpu_bind_type_names[] = {
+		{CPU_BIND_VERBOSE, "verbose"},
+		{CPU_BIND_TO_THREADS, "threads"},
+		{CPU_BIND_TO_CORES, "cores"},
+		{CPU_BIND_TO_SOCKETS, "sockets"},
+		{CPU_BIND_TO_LDOMS, "ldoms"},
+		{CPU_BIND_NONE, "none"},
+		{CPU_BIND_RANK, "rank"},
+		{CPU_BIND_MAP, "map_cpu"},
+		{CPU_BIND_MASK, "mask_cpu"},
+		{CPU_BIND_LDRANK, "rank_ldom"},
+		{CPU_BIND_LDMAP, "map_ldom"},
+		{CPU_BIND_LDMASK, "mask_ldom"},
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(19, 5, 0)
+		{CPU_BIND_ONE_THREAD_PER_CORE, "one_thread"},
+#endif
+		{0, NULL}};
+
+// Spelled as for ``srun --mem-bind``
+static const struct flag_name mem_bind_type_names[] = {
+		{MEM_BIND_VERBOSE, "verbose"},
+		{MEM_BIND_NONE, "none"},
+		{MEM_BIND_RANK, "rank"},
+		{MEM_BIND_MAP, "map_mem"},
+		{MEM_BIND_MASK, "mask_mem"},
+		{MEM_BIND_LOCAL, "local"},
+		{MEM_BIND_SORT, "sort"},
+		{MEM_BIND_PREFER, "prefer"},
+		{0, NULL}};
+
+// The flags are internal to slurmctld, so they keep their macro names
+static const struct flag_name bitflags_names[] = {
+#ifdef KILL_INV_DEP
+		FLAG_NAME(KILL_INV_DEP),
+#endif
+#ifdef NO_KILL_INV_DEP
+		FLAG_NAME(NO_KILL_INV_DEP),
+#endif
+#ifdef HAS_STATE_DIR
+		FLAG_NAME(HAS_STATE_DIR),
+#endif
+#ifdef BACKFILL_TEST
+		FLAG_NAME(BACKFILL_TEST),
+#endif
+#ifdef GRES_ENFORCE_BIND
+		FLAG_NAME(GRES_ENFORCE_BIND),
+#endif
+#ifdef TEST_NOW_ONLY
+		FLAG_NAME(TEST_NOW_ONLY),
+#endif
+#ifdef JOB_SEND_ENV
+		FLAG_NAME(JOB_SEND_ENV),
+#endif
+#ifdef NODE_REBOOT
+		FLAG_NAME(NODE_REBOOT),
+#endif
+#ifdef SPREAD_JOB
+		FLAG_NAME(SPREAD_JOB),
+#endif
+#ifdef USE_MIN_NODES
+		FLAG_NAME(USE_MIN_NODES),
+#endif
+#ifdef JOB_KILL_HURRY
+		FLAG_NAME(JOB_KILL_HURRY),
+#endif
+#ifdef TRES_STR_CALC
+		FLAG_NAME(TRES_STR_CALC),
+#endif
+#ifdef SIB_JOB_FLUSH
+		FLAG_NAME(SIB_JOB_FLUSH),
+#endif
+#ifdef HET_JOB_FLAG
+		FLAG_NAME(HET_JOB_FLAG),
+#endif
+#ifdef JOB_NTASKS_SET
+		FLAG_NAME(JOB_NTASKS_SET),
+#endif
+#ifdef JOB_CPUS_SET
+		FLAG_NAME(JOB_CPUS_SET),
+#endif
+#ifdef BF_WHOLE_NODE_TEST
+		FLAG_NAME(BF_WHOLE_NODE_TEST),
+#endif
+#ifdef TOP_PRIO_TMP
+		FLAG_NAME(TOP_PRIO_TMP),
+#endif
+#ifdef JOB_ACCRUE_OVER
+		FLAG_NAME(JOB_ACCRUE_OVER),
+#endif
+#ifdef GRES_DISABLE_BIND
+		FLAG_NAME(GRES_DISABLE_BIND),
+#endif
+#ifdef JOB_WAS_RUNNING
+		FLAG_NAME(JOB_WAS_RUNNING),
+#endif
+#ifdef RESET_ACCRUE_TIME
+		FLAG_NAME(RESET_ACCRUE_TIME),
+#endif
+#ifdef CRON_JOB
+		FLAG_NAME(CRON_JOB),
+#endif
+#ifdef JOB_MEM_SET
+		FLAG_NAME(JOB_MEM_SET),
+#endif
+#ifdef USE_DEFAULT_ACCT
+		FLAG_NAME(USE_DEFAULT_ACCT),
+#endif
+#ifdef USE_DEFAULT_PART
+		FLAG_NAME(USE_DEFAULT_PART),
+#endif
+#ifdef USE_DEFAULT_QOS
+		FLAG_NAME(USE_DEFAULT_QOS),
+#endif
+#ifdef USE_DEFAULT_WCKEY
+		FLAG_NAME(USE_DEFAULT_WCKEY),
+#endif
+#ifdef JOB_DEPENDENT
+		FLAG_NAME(JOB_DEPENDENT),
+#endif
+#ifdef MAGNETIC
+		FLAG_NAME(MAGNETIC),
+#endif
+#ifdef PARTITION_ASSIGNED
+		FLAG_NAME(PARTITION_ASSIGNED),
+#endif
+#ifdef BACKFILL_SCHED
+		FLAG_NAME(BACKFILL_SCHED),
+#endif
+#ifdef BACKFILL_LAST
+		FLAG_NAME(BACKFILL_LAST),
+#endif
+#ifdef TASKS_CHANGED
+		FLAG_NAME(TASKS_CHANGED),
+#endif
+#ifdef JOB_SEND_SCRIPT
+		FLAG_NAME(JOB_SEND_SCRIPT),
+#endif
+		{0, NULL}};
+
+/*
+ * Return a frozenset of the names of the bits set in ``value``
+ */
+static PyObject *flags_to_python(uint64_t value, const struct flag_name *names)
+{
+	PyObject *set = PyFrozenSet_New(NULL);
+	if (set == NULL)
+		return NULL;
+
+	for (; names->name; ++names)
+	{
+		if ((value & names->flag) != names->flag)
+			continue;
+		PyObject *name = PyUnicode_FromString(names->name);
+		if (name == NULL || PySet_Add(set, name) < 0)
+		{
+			Py_XDECREF(name);
+			Py_DECREF(set);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+
+	return set;
+}
+
+/*
+ * Turn an iterable of flag names, or a comma separated string of them, back
+ * into bits. Return false and set a Python error if a name is unknown.
+ */
+static bool python_to_flags(PyObject *obj, const struct flag_name *names, uint64_t *value)
+{
+	PyObject *iter;
+	if (PyUnicode_Check(obj))
+	{
+		PyObject *comma = PyUnicode_FromString(",");
+		PyObject *list = comma ? PyUnicode_Split(obj, comma, -1) : NULL;
+		Py_XDECREF(comma);
+		iter = list ? PyObject_GetIter(list) : NULL;
+		Py_XDECREF(list);
+	}
+	else
+	{
+		iter = PyObject_GetIter(obj);
+	}
+	if (iter == NULL)
+		return false;
+
+	uint64_t flags = 0;
+	PyObject *item;
+	while ((item = PyIter_Next(iter)))
+	{
+		Py_ssize_t len;
+		const char *name = PyUnicode_AsUTF8AndSize(item, &len);
+		const struct flag_name *entry = names;
+		if (name != NULL)
+		{
+			// Tolerate "BEGIN, END" and a trailing comma
+			while (len && isspace((unsigned char)*name))
+				++name, --len;
+			while (len && isspace((unsigned char)name[len - 1]))
+				--len;
+			for (; entry->name && len; ++entry)
+			{
+				if (strlen(entry->name) == (size_t)len && !strncasecmp(entry->name, name, len))
+					break;
+			}
+			if (len && entry->name == NULL)
+				PyErr_Format(PyExc_ValueError, "unknown flag \"%.*s\"", (int)len, name);
+		}
+		Py_DECREF(item);
+		if (PyErr_Occurred())
+			break;
+		if (len)
+			flags |= entry->flag;
+	}
+	Py_DECREF(iter);
+
+	if (PyErr_Occurred())
+		return false;
+	*value = flags;
+	return true;
+}
+
+/*
+ * Return ``{"mb", "per_cpu", "per_node"}`` for a ``pn_min_memory`` value
+ */
+static PyObject *memory_to_python(uint64_t value)
+{
+	if (value == NO_VAL64)
+		Py_RETURN_NONE;
+
+	bool per_cpu = (value & MEM_PER_CPU) != 0;
+	return Py_BuildValue("{s:K,s:O,s:O}", "mb", (unsigned long long)(value & ~MEM_PER_CPU),
+						 "per_cpu", per_cpu ? Py_True : Py_False, "per_node", per_cpu ? Py_False : Py_True);
+}
+
+/*
+ * Turn a mapping with ``mb`` and ``per_cpu`` or ``per_node`` back into a
+ * ``pn_min_memory`` value. Per node is assumed if neither is given.
+ */
+static bool python_to_memory(PyObject *obj, uint64_t *value)
+{
+	PyObject *mb = PyMapping_GetItemString(obj, "mb");
+	if (mb == NULL)
+		return false;
+	uint64_t memory = PyLong_AsUnsignedLongLong(mb);
+	Py_DECREF(mb);
+	if (PyErr_Occurred())
+		return false;
+
+	bool per_cpu = false;
+	PyObject *flag;
+	if ((flag = PyMapping_GetItemString(obj, "per_cpu")))
+	{
+		per_cpu = PyObject_IsTrue(flag);
+		Py_DECREF(flag);
+	}
+	else if ((PyErr_Clear(), flag = PyMapping_GetItemString(obj, "per_node")))
+	{
+		per_cpu = !PyObject_IsTrue(flag);
+		Py_DECREF(flag);
+	}
+	PyErr_Clear();
+
+	*value = per_cpu ? (memory | MEM_PER_CPU) : memory;
+	return true;
+}
+
+/*
+ * ``slurm.DecodedView``, the ``decoded`` entry of the job descriptor. It
+ * presents ``pn_min_memory`` and the packed flag fields of the submitted job
+ * in the forms accepted on write-back, decoding each on first access.
+ */
+enum
+{
+	DECODED_PN_MIN_MEMORY,
+	DECODED_BITFLAGS,
+	DECODED_MAIL_TYPE,
+	DECODED_CPU_BIND_TYPE,
+	DECODED_MEM_BIND_TYPE,
+	DECODED_COUNT
+};
+
+typedef struct
+{
+	PyObject_HEAD
+	uint64_t generation;
+	PyObject *decoded[DECODED_COUNT];
+} DecodedViewObject;
+
+static PyTypeObject *DecodedViewType = NULL;
+
+static void decoded_view_dealloc(DecodedViewObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	for (int i = 0; i < DECODED_COUNT; ++i)
+		Py_XDECREF(self->decoded[i]);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyObject *decoded_view_get(DecodedViewObject *self, void *closure)
+{
+	intptr_t field = (intptr_t)closure;
+
+	if (field < 0 || field >= DECODED_COUNT)
+	{
+		PyErr_BadInternalCall();
+		return NULL;
+	}
+
+	if (self->decoded[field] == NULL)
+	{
+		if (!check_generation(self->generation))
+			return NULL;
+
+		struct job_descriptor *job_desc = current_job_desc;
+		PyObject *obj = NULL;
+		switch (field)
+		{
+		case DECODED_PN_MIN_MEMORY:
+			obj = memory_to_python(job_desc->pn_min_memory);
+			break;
+		case DECODED_BITFLAGS:
+			obj = flags_to_python(job_desc->bitflags, bitflags_names);
+			break;
+		case DECODED_MAIL_TYPE:
+			if (job_desc->mail_type == NO_VAL16)
+				obj = (Py_INCREF(Py_None), Py_None);
+			else
+				obj = flags_to_python(job_desc->mail_type, mail_type_names);
+			break;
+		case DECODED_CPU_BIND_TYPE:
+			if (job_desc->cpu_bind_type == NO_VAL16)
+				obj = (Py_INCREF(Py_None), Py_None);
+			else
+				obj = flags_to_python(job_desc->cpu_bind_type, cpu_bind_type_names);
+			break;
+		case DECODED_MEM_BIND_TYPE:
+			if (job_desc->mem_bind_type == NO_VAL16)
+				obj = (Py_INCREF(Py_None), Py_None);
+			else
+				obj = flags_to_python(job_desc->mem_bind_type, mem_bind_type_names);
+			break;
+		}
+		if (obj == NULL)
+			return NULL;
+		self->decoded[field] = obj;
+	}
+
+	Py_INCREF(self->decoded[field]);
+	return self->decoded[field];
+}
+
+static PyGetSetDef DecodedViewGetSet[] = {
+		{"pn_min_memory", (getter)decoded_view_get, NULL, NULL, (void *)DECODED_PN_MIN_MEMORY},
+		{"bitflags", (getter)decoded_view_get, NULL, NULL, (void *)DECODED_BITFLAGS},
+		{"mail_type", (getter)decoded_view_get, NULL, NULL, (void *)DECODED_MAIL_TYPE},
+		{"cpu_bind_type", (getter)decoded_view_get, NULL, NULL, (void *)DECODED_CPU_BIND_TYPE},
+		{"mem_bind_type", (getter)decoded_view_get, NULL, NULL, (void *)DECODED_MEM_BIND_TYPE},
+		{NULL}};
+
+static PyType_Slot DecodedViewSlots[] = {
+		{Py_tp_dealloc, decoded_view_dealloc},
+		{Py_tp_getset, DecodedViewGetSet},
+		{0, NULL}};
+
+static PyType_Spec DecodedViewSpec = {
+		"slurm.DecodedView", sizeof(DecodedViewObject), 0, Py_TPFLAGS_DEFAULT, DecodedViewSlots};
+
+/*
+ * Return a new ``slurm.DecodedView`` for the submission being evaluated
+ */
+static PyObject *create_decoded_view(void)
+{
+	DecodedViewObject *view = PyObject_New(DecodedViewObject, DecodedViewType);
+	if (view == NULL)
+		return NULL;
+	view->generation = current_generation;
+	memset(view->decoded, 0, sizeof(view->decoded));
+	return (PyObject *)view;
+}
+
+/*
+ * Totals requested by a job, following Slurm's defaults for unset fields
+ */
+struct resource_totals
+{
+	uint64_t nodes;
+	uint64_t tasks;
+	uint64_t cpus;
+	uint64_t memory_mb; // NO_VAL64 if the whole memory of the nodes or unknown
+	uint64_t gpus;
+	uint32_t time_limit; // minutes, NO_VAL if the partition default applies
+};
+
+/*
+ * Return the GPUs requested per unit by a TRES string, 0 if none
+ */
+static uint64_t tres_string_gpus(const char *str)
+{
+	struct tres_request *reqs;
+	int count = str ? lookup_tres_string(str, &reqs) : 0;
+	uint64_t gpus = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		if (!strcmp(reqs[i].type, "gres") && !strcmp(reqs[i].name, "gpu"))
+			gpus += reqs[i].count;
+	}
+	return gpus;
+}
+
+static void compute_resource_totals(const struct job_descriptor *job_desc, struct resource_totals *totals)
+{
+	totals->nodes = job_desc->min_nodes != NO_VAL && job_desc->min_nodes ? job_desc->min_nodes : 1;
+
+	// One task per node unless given
+	if (job_desc->num_tasks != NO_VAL && job_desc->num_tasks)
+		totals->tasks = job_desc->num_tasks;
+	else if (job_desc->ntasks_per_node != NO_VAL16 && job_desc->ntasks_per_node)
+		totals->tasks = totals->nodes * job_desc->ntasks_per_node;
+	else
+		totals->tasks = totals->nodes;
+
+	uint64_t cpus_per_task = job_desc->cpus_per_task != NO_VAL16 && job_desc->cpus_per_task ? job_desc->cpus_per_task : 1;
+	totals->cpus = totals->tasks * cpus_per_task;
+	if (job_desc->min_cpus != NO_VAL && job_desc->min_cpus > totals->cpus)
+		totals->cpus = job_desc->min_cpus;
+	if (job_desc->pn_min_cpus != NO_VAL16 && totals->nodes * job_desc->pn_min_cpus > totals->cpus)
+		totals->cpus = totals->nodes * job_desc->pn_min_cpus;
+
+	totals->gpus = 0;
+	uint64_t mem_per_gpu = 0;
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
+	uint64_t sockets = totals->nodes *
+					   (job_desc->sockets_per_node != NO_VAL16 && job_desc->sockets_per_node ? job_desc->sockets_per_node : 1);
+	totals->gpus = tres_string_gpus(job_desc->tres_per_job) + totals->nodes * tres_string_gpus(job_desc->tres_per_node) +
+				   sockets * tres_string_gpus(job_desc->tres_per_socket) + totals->tasks * tres_string_gpus(job_desc->tres_per_task);
+	if (totals->gpus * tres_string_gpus(job_desc->cpus_per_tres) > totals->cpus)
+		totals->cpus = totals->gpus * tres_string_gpus(job_desc->cpus_per_tres);
+	mem_per_gpu = tres_string_gpus(job_desc->mem_per_tres);
+#else
+	totals->gpus = totals->nodes * tres_string_gpus(job_desc->gres);
+#endif
+
+	// --mem-per-gpu, else DefMemPerCPU or DefMemPerNode when not given
+	uint64_t memory = job_desc->pn_min_memory;
+	totals->memory_mb = NO_VAL64;
+	if (memory == NO_VAL64 && mem_per_gpu && totals->gpus)
+	{
+		totals->memory_mb = mem_per_gpu * totals->gpus;
+	}
+	else
+	{
+		if (memory == NO_VAL64)
+			memory = controller_conf.def_mem_per_cpu;
+		// 0 is the whole memory of the nodes
+		if (memory != NO_VAL64 && (memory & ~MEM_PER_CPU))
+		{
+			if (memory & MEM_PER_CPU)
+				totals->memory_mb = (memory & ~MEM_PER_CPU) * totals->cpus;
+			else
+				totals->memory_mb = memory * totals->nodes;
+		}
+	}
+
+	totals->time_limit = job_desc->time_limit;
+	if (totals->time_limit == INFINITE)
+		totals->time_limit = NO_VAL;
+}
+
+/*
+ * ``slurm.ResourceView``, the ``resources`` entry of the job descriptor with
+ * the totals requested by the submitted job, computed on first access
+ */
+enum
+{
+	RESOURCE_NODES,
+	RESOURCE_TASKS,
+	RESOURCE_CPUS,
+	RESOURCE_MEMORY_MB,
+	RESOURCE_GPUS,
+	RESOURCE_TIME_LIMIT,
+	RESOURCE_TRES_MINUTES
+};
+
+typedef struct
+{
+	PyObject_HEAD
+	uint64_t generation;
+	bool computed;
+	struct resource_totals totals;
+} ResourceViewObject;
+
+static PyTypeObject *ResourceViewType = NULL;
+
+static void resource_view_dealloc(ResourceViewObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyObject *resource_view_get(ResourceViewObject *self, void *closure)
+{
+	if (!self->computed)
+	{
+		if (!check_generation(self->generation))
+			return NULL;
+		compute_resource_totals(current_job_desc, &self->totals);
+		self->computed = true;
+	}
+
+	const struct resource_totals *totals = &self->totals;
+	switch ((intptr_t)closure)
+	{
+	case RESOURCE_NODES:
+		return PyLong_FromUnsignedLongLong(totals->nodes);
+	case RESOURCE_TASKS:
+		return PyLong_FromUnsignedLongLong(totals->tasks);
+	case RESOURCE_CPUS:
+		return PyLong_FromUnsignedLongLong(totals->cpus);
+	case RESOURCE_MEMORY_MB:
+		if (totals->memory_mb == NO_VAL64)
+			Py_RETURN_NONE;
+		return PyLong_FromUnsignedLongLong(totals->memory_mb);
+	case RESOURCE_GPUS:
+		return PyLong_FromUnsignedLongLong(totals->gpus);
+	case RESOURCE_TIME_LIMIT:
+		if (totals->time_limit == NO_VAL)
+			Py_RETURN_NONE;
+		return PyLong_FromUnsignedLong(totals->time_limit);
+	case RESOURCE_TRES_MINUTES:
+	{
+		if (totals->time_limit == NO_VAL)
+			Py_RETURN_NONE;
+		unsigned long long minutes = totals->time_limit;
+		PyObject *dict = Py_BuildValue("{s:K,s:K,s:K}", "cpu", totals->cpus * minutes, "node", totals->nodes * minutes,
+									   "gres/gpu", totals->gpus * minutes);
+		if (dict && totals->memory_mb != NO_VAL64)
+		{
+			PyObject *mem = PyLong_FromUnsignedLongLong(totals->memory_mb * minutes);
+			if (mem == NULL || PyDict_SetItemString(dict, "mem", mem) < 0)
+				Py_CLEAR(dict);
+			Py_XDECREF(mem);
+		}
+		return dict;
+	}
+	}
+
+	PyErr_BadInternalCall();
+	return NULL;
+}
+
+static PyGetSetDef ResourceViewGetSet[] = {
+		{"nodes", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_NODES},
+		{"tasks", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_TASKS},
+		{"cpus", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_CPUS},
+		{"memory_mb", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_MEMORY_MB},
+		{"gpus", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_GPUS},
+		{"time_limit", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_TIME_LIMIT},
+		{"tres_minutes", (getter)resource_view_get, NULL, NULL, (void *)RESOURCE_TRES_MINUTES},
+		{NULL}};
+
+static PyType_Slot ResourceViewSlots[] = {
+		{Py_tp_dealloc, resource_view_dealloc},
+		{Py_tp_getset, ResourceViewGetSet},
+		{0, NULL}};
+
+static PyType_Spec ResourceViewSpec = {
+		"slurm.ResourceView", sizeof(ResourceViewObject), 0, Py_TPFLAGS_DEFAULT, ResourceViewSlots};
+
+/*
+ * Return a new ``slurm.ResourceView`` for the submission being evaluated
+ */
+static PyObject *create_resource_view(void)
+{
+	ResourceViewObject *view = PyObject_New(ResourceViewObject, ResourceViewType);
+	if (view == NULL)
+		return NULL;
+	view->generation = current_generation;
+	view->computed = false;
+	return (PyObject *)view;
+}
+
+/*
+ * ``slurm.AssociationView``, a read-only view of an association record of
+ * the controller. Every attribute read looks the record up again under the
+ * association manager's read lock, so the values are current.
+ */
+enum association_kind
+{
+	ASSOC_UINT32,
+	ASSOC_STRING,
+	ASSOC_USAGE_RAW,
+	ASSOC_USED_JOBS,
+	ASSOC_USED_SUBMIT_JOBS
+};
+
+struct association_field
+{
+	const char *name;
+	enum association_kind kind;
+	size_t offset;
+};
+
+#define ASSOC_FIELD(name, kind, member) {name, kind, offsetof(slurmdb_assoc_rec_t, member)}
+
+static const struct association_field association_fields[] = {
+		ASSOC_FIELD("id", ASSOC_UINT32, id),
+		ASSOC_FIELD("user", ASSOC_STRING, user),
+		ASSOC_FIELD("account", ASSOC_STRING, acct),
+		ASSOC_FIELD("partition", ASSOC_STRING, partition),
+		ASSOC_FIELD("parent_account", ASSOC_STRING, parent_acct),
+		ASSOC_FIELD("shares_raw", ASSOC_UINT32, shares_raw),
+		ASSOC_FIELD("grp_jobs", ASSOC_UINT32, grp_jobs),
+		ASSOC_FIELD("grp_submit_jobs", ASSOC_UINT32, grp_submit_jobs),
+		ASSOC_FIELD("grp_tres", ASSOC_STRING, grp_tres),
+		ASSOC_FIELD("grp_tres_mins", ASSOC_STRING, grp_tres_mins),
+		ASSOC_FIELD("grp_tres_run_mins", ASSOC_STRING, grp_tres_run_mins),
+		ASSOC_FIELD("grp_wall", ASSOC_UINT32, grp_wall),
+		ASSOC_FIELD("max_jobs", ASSOC_UINT32, max_jobs),
+		ASSOC_FIELD("max_submit_jobs", ASSOC_UINT32, max_submit_jobs),
+		ASSOC_FIELD("max_tres_per_job", ASSOC_STRING, max_tres_pj),
+		ASSOC_FIELD("max_tres_per_node", ASSOC_STRING, max_tres_pn),
+		ASSOC_FIELD("max_tres_mins_per_job", ASSOC_STRING, max_tres_mins_pj),
+		ASSOC_FIELD("max_wall_per_job", ASSOC_UINT32, max_wall_pj),
+		{"raw_usage", ASSOC_USAGE_RAW, 0},
+		{"used_jobs", ASSOC_USED_JOBS, 0},
+		{"used_submit_jobs", ASSOC_USED_SUBMIT_JOBS, 0},
+		{NULL}};
+
+typedef struct
+{
+	PyObject_HEAD
+	uint64_t generation;
+	uint32_t uid;
+	char *account;
+	char *partition;
+} AssociationViewObject;
+
+static PyTypeObject *AssociationViewType = NULL;
+
+/*
+ * Find the association of ``uid``, ``account`` and ``partition``. The
+ * default account of the user is used if ``account`` is NULL. The caller
+ * holds the association read lock, and the user read lock needed to look up
+ * that default account.
+ */
+static slurmdb_assoc_rec_t *find_association(uint32_t uid, const char *account, const char *partition)
+{
+	slurmdb_assoc_rec_t req, *assoc = NULL;
+	memset(&req, 0, sizeof(req));
+	req.uid = uid;
+	req.acct = (char *)account;
+	req.partition = (char *)partition;
+
+	if (assoc_mgr_fill_in_assoc(acct_db_conn, &req, accounting_enforce, &assoc, true) != SLURM_SUCCESS)
+		return NULL;
+	return assoc;
+}
+
+static void association_view_dealloc(AssociationViewObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	xfree(self->account);
+	xfree(self->partition);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+static PyObject *association_view_get(AssociationViewObject *self, void *closure)
+{
+	const struct association_field *field = closure;
+	assoc_mgr_lock_t locks = {.assoc = READ_LOCK, .user = READ_LOCK};
+	bool found = true, set = true;
+	uint32_t number = 0;
+	long double usage = 0;
+	char *str = NULL;
+
+	if (!check_generation(self->generation))
+		return NULL;
+
+	// Copy the value out so that no Python code runs under the lock
+	assoc_mgr_lock(&locks);
+	slurmdb_assoc_rec_t *assoc = find_association(self->uid, self->account, self->partition);
+	if (assoc == NULL)
+		found = false;
+	else if (field->kind == ASSOC_UINT32)
+		number = *(uint32_t *)((char *)assoc + field->offset);
+	else if (field->kind == ASSOC_STRING)
+		str = xstrdup(*(char **)((char *)assoc + field->offset));
+	else if (assoc->usage == NULL)
+		set = false;
+	else if (field->kind == ASSOC_USAGE_RAW)
+		usage = assoc->usage->usage_raw;
+	else if (field->kind == ASSOC_USED_JOBS)
+		number = assoc->usage->used_jobs;
+	else
+		number = assoc->usage->used_submit_jobs;
+	assoc_mgr_unlock(&locks);
+
+	if (!found)
+	{
+		PyErr_SetString(PyExc_LookupError, "association no longer exists");
+		return NULL;
+	}
+
+	PyObject *obj;
+	if (field->kind == ASSOC_STRING && str)
+		obj = PyUnicode_DecodeUTF8(str, strlen(str), "surrogateescape");
+	else if (!set || field->kind == ASSOC_STRING || ((field->kind == ASSOC_UINT32) && (number == NO_VAL || number == INFINITE)))
+		obj = (Py_INCREF(Py_None), Py_None);
+	else if (field->kind == ASSOC_USAGE_RAW)
+		obj = PyFloat_FromDouble((double)usage);
+	else
+		obj = PyLong_FromUnsignedLong(number);
+	xfree(str);
+	return obj;
+}
+
+static PyGetSetDef AssociationViewGetSet[sizeof(association_fields) / sizeof(association_fields[0])];
+
+static PyType_Slot AssociationViewSlots[] = {
+		{Py_tp_dealloc, association_view_dealloc},
+		{Py_tp_getset, AssociationViewGetSet},
+		{0, NULL}};
+
+static PyType_Spec AssociationViewSpec = {
+		"slurm.AssociationView", sizeof(AssociationViewObject), 0, Py_TPFLAGS_DEFAULT, AssociationViewSlots};
+
+/*
+ * Fill the attribute table of ``slurm.AssociationView`` from
+ * ``association_fields``
+ */
+static void init_association_getset(void)
+{
+	for (int i = 0; association_fields[i].name; ++i)
+	{
+		AssociationViewGetSet[i].name = association_fields[i].name;
+		AssociationViewGetSet[i].get = (getter)association_view_get;
+		AssociationViewGetSet[i].closure = (void *)&association_fields[i];
+	}
+}
+
+/*
+ * Return a ``slurm.AssociationView`` of the association of a user, None if
+ * there is none. The default account of the user is used unless
+ * ``account`` is given.
+ */
+static PyObject *py_slurm_association(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"uid", "account", "partition", NULL};
+	unsigned int uid;
+	const char *account = NULL, *partition = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|zz", keywords, &uid, &account, &partition))
+		return NULL;
+
+	if (current_job_desc == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "associations can only be read while a job is evaluated");
+		return NULL;
+	}
+
+	assoc_mgr_lock_t locks = {.assoc = READ_LOCK, .user = READ_LOCK};
+	assoc_mgr_lock(&locks);
+	bool found = find_association(uid, account, partition) != NULL;
+	assoc_mgr_unlock(&locks);
+	if (!found)
+		Py_RETURN_NONE;
+
+	AssociationViewObject *view = PyObject_New(AssociationViewObject, AssociationViewType);
+	if (view == NULL)
+		return NULL;
+	view->generation = current_generation;
+	view->uid = uid;
+	view->account = xstrdup(account);
+	view->partition = xstrdup(partition);
+	return (PyObject *)view;
+}
+
+#define BIT_WORD(bits, words, row, bit) ((bits)[(size_t)(row) * (words) + (bit) / 64])
+#define BIT_TEST(bits, words, row, bit) ((BIT_WORD(bits, words, row, bit) >> ((bit) % 64)) & 1)
+#define BIT_SET(bits, words, row, bit) (BIT_WORD(bits, words, row, bit) |= 1ull << ((bit) % 64))
+
+static void node_index_flush(void)
+{
+	for (int i = 0; i < node_index.feature_count; ++i)
+		xfree(node_index.features[i]);
+	for (int i = 0; i < node_index.partition_count; ++i)
+		xfree(node_index.partitions[i]);
+	for (int i = 0; node_index.gres_start && i < node_index.gres_start[node_index.node_count]; ++i)
+	{
+		xfree(node_index.gres[i].name);
+		xfree(node_index.gres[i].model);
+	}
+	xfree(node_index.features);
+	xfree(node_index.feature_hashes);
+	xfree(node_index.node_features);
+	xfree(node_index.partitions);
+	xfree(node_index.node_partitions);
+	xfree(node_index.gres_start);
+	xfree(node_index.gres);
+	for (int i = 0; node_index.summaries && i <= node_index.partition_count; ++i)
+	{
+		struct node_summary *summary = &node_index.summaries[i];
+		for (int g = 0; g < summary->gres_count; ++g)
+			xfree(summary->gres_names[g]);
+		xfree(summary->gres_names);
+		xfree(summary->gres_counts);
+		xfree(summary->feature_nodes);
+	}
+	xfree(node_index.summaries);
+	memset(&node_index, 0, sizeof(node_index));
+}
+
+/*
+ * Return the index of ``name`` in ``*names``, adding it if missing
+ */
+static int intern_name(char ***names, uint32_t **hashes, int *count, const char *name, size_t len)
+{
+	char *copy = xstrndup(name, len);
+	uint32_t hash = hash_string(copy);
+	for (int i = 0; i < *count; ++i)
+	{
+		if ((!hashes || (*hashes)[i] == hash) && !strcmp((*names)[i], copy))
+		{
+			xfree(copy);
+			return i;
+		}
+	}
+	xrealloc(*names, (*count + 1) * sizeof(char *));
+	(*names)[*count] = copy;
+	if (hashes)
+	{
+		xrealloc(*hashes, (*count + 1) * sizeof(uint32_t));
+		(*hashes)[*count] = hash;
+	}
+	return (*count)++;
+}
+
+/*
+ * Append the GRES of a node configuration string such as
+ * ``gpu:a100:4(S:0-1),shard:8``, ignoring socket bindings
+ */
+static void add_node_gres(const char *str, struct node_gres **gres, int *count)
+{
+	char *copy = xstrdup(str), *w = copy;
+	for (const char *p = str; p && *p; ++p)
+	{
+		if (*p == '(')
+		{
+			p = strchr(p, ')');
+			if (p == NULL)
+				break;
+			continue;
+		}
+		*w++ = *p;
+	}
+	if (copy)
+		*w = '\0';
+
+	struct tres_request *reqs;
+	int n = copy && *copy ? lookup_tres_string(copy, &reqs) : 0;
+	for (int i = 0; i < n; ++i)
+	{
+		if (strcmp(reqs[i].type, "gres"))
+			continue;
+		xrealloc(*gres, (*count + 1) * sizeof(struct node_gres));
+		(*gres)[*count].name = xstrdup(reqs[i].name);
+		(*gres)[*count].model = xstrdup(reqs[i].model);
+		(*gres)[*count].count = reqs[i].count;
+		++*count;
+	}
+	xfree(copy);
+}
+
+/*
+ * Rebuild the node index if the node table or the partitions changed. The
+ * caller holds the node and partition read locks, as the plugin is called.
+ */
+static void node_index_refresh(void)
+{
+	if (node_index.valid && node_index.node_update == last_node_update && node_index.part_update == last_part_update)
+		return;
+
+	node_index_flush();
+	node_index.node_update = last_node_update;
+	node_index.part_update = last_part_update;
+
+	// First pass for the distinct names, second one for the bitsets
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		int node = 0, gres_count = 0;
+		struct node_record *node_ptr;
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(22, 5, 0)
+		for (int i = 0; (node_ptr = next_node(&i)); ++i, ++node)
+#else
+		for (int i = 0; i < node_record_count && (node_ptr = node_record_table_ptr + i); ++i, ++node)
+#endif
+		{
+			const char *features = node_ptr->features_act ? node_ptr->features_act : node_ptr->features;
+			for (const char *p = features; p && *p;)
+			{
+				size_t len = strcspn(p, ",");
+				if (len)
+				{
+					int f = intern_name(&node_index.features, &node_index.feature_hashes, &node_index.feature_count, p, len);
+					if (pass)
+						BIT_SET(node_index.node_features, node_index.feature_words, node, f);
+				}
+				p += len + (p[len] == ',');
+			}
+
+			for (int j = 0; j < node_ptr->part_cnt; ++j)
+			{
+				const char *name = node_ptr->part_pptr[j]->name;
+				int part = intern_name(&node_index.partitions, NULL, &node_index.partition_count, name, strlen(name));
+				if (pass)
+					BIT_SET(node_index.node_partitions, node_index.partition_words, node, part);
+			}
+
+			if (pass)
+			{
+				node_index.gres_start[node] = gres_count;
+				add_node_gres(node_ptr->gres, &node_index.gres, &gres_count);
+			}
+		}
+
+		node_index.node_count = node;
+		if (pass == 0)
+		{
+			node_index.summaries = xcalloc(node_index.partition_count + 1, sizeof(struct node_summary));
+			node_index.feature_words = (node_index.feature_count + 63) / 64;
+			node_index.partition_words = (node_index.partition_count + 63) / 64;
+			node_index.node_features = xcalloc((size_t)node * node_index.feature_words + 1, sizeof(uint64_t));
+			node_index.node_partitions = xcalloc((size_t)node * node_index.partition_words + 1, sizeof(uint64_t));
+			node_index.gres_start = xcalloc(node + 1, sizeof(int));
+		}
+		else
+		{
+			node_index.gres_start[node] = gres_count;
+		}
+	}
+
+	node_index.valid = true;
+	++node_index_version;
+}
+
+/*
+ * Return the index of partition ``name``, -1 for all nodes, -2 if unknown
+ */
+static int node_index_partition(const char *name)
+{
+	if (name == NULL)
+		return -1;
+	for (int i = 0; i < node_index.partition_count; ++i)
+	{
+		if (!strcmp(node_index.partitions[i], name))
+			return i;
+	}
+	return -2;
+}
+
+/*
+ * Add ``count`` to the GRES ``name`` of ``summary``
+ */
+static void summary_add_gres(struct node_summary *summary, const char *name, uint64_t count)
+{
+	int known = summary->gres_count;
+	int g = intern_name(&summary->gres_names, NULL, &summary->gres_count, name, strlen(name));
+	if (g == known)
+	{
+		xrealloc(summary->gres_counts, summary->gres_count * sizeof(uint64_t));
+		summary->gres_counts[g] = 0;
+	}
+	summary->gres_counts[g] += count;
+}
+
+/*
+ * Return the totals of partition ``part``, or of all nodes for -1, building
+ * them if the index was refreshed since
+ */
+static const struct node_summary *node_index_summary(int part)
+{
+	struct node_summary *summary = &node_index.summaries[part >= 0 ? part : node_index.partition_count];
+	if (summary->valid)
+		return summary;
+
+	summary->feature_nodes = xcalloc(node_index.feature_count + 1, sizeof(uint32_t));
+	for (int node = 0; node < node_index.node_count; ++node)
+	{
+		if (part >= 0 && !BIT_TEST(node_index.node_partitions, node_index.partition_words, node, part))
+			continue;
+		++summary->nodes;
+		const uint64_t *row = node_index.node_features + (size_t)node * node_index.feature_words;
+		for (int w = 0; w < node_index.feature_words; ++w)
+		{
+			for (uint64_t bits = row[w]; bits; bits &= bits - 1)
+				++summary->feature_nodes[w * 64 + __builtin_ctzll(bits)];
+		}
+		for (int g = node_index.gres_start[node]; g < node_index.gres_start[node + 1]; ++g)
+		{
+			const struct node_gres *entry = &node_index.gres[g];
+			summary_add_gres(summary, entry->name, entry->count);
+			if (entry->model)
+			{
+				char *typed = xstrdup_printf("%s:%s", entry->name, entry->model);
+				summary_add_gres(summary, typed, entry->count);
+				xfree(typed);
+			}
+		}
+	}
+	summary->valid = true;
+	return summary;
+}
+
+/*
+ * Return ``{"nodes", "features", "gres", "partitions"}`` describing the
+ * nodes of a partition, or of the whole cluster. ``features`` maps each
+ * feature to its number of nodes and ``gres`` each GRES, both as ``gpu`` and
+ * ``gpu:a100``, to the total count. Return None for an unknown partition.
+ * The totals are kept until the node index is refreshed, so only the dicts
+ * are built on each call.
+ */
+static PyObject *py_slurm_node_inventory(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"partition", NULL};
+	const char *partition = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|z", keywords, &partition))
+		return NULL;
+
+	if (current_job_desc == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "nodes can only be read while a job is evaluated");
+		return NULL;
+	}
+
+	node_index_refresh();
+	int part = node_index_partition(partition);
+	if (part == -2)
+		Py_RETURN_NONE;
+
+	const struct node_summary *summary = node_index_summary(part);
+	PyObject *gres = PyDict_New(), *features = PyDict_New(), *partitions = PyList_New(0), *result = NULL;
+
+	for (int g = 0; gres && g < summary->gres_count; ++g)
+	{
+		PyObject *count = PyLong_FromUnsignedLongLong(summary->gres_counts[g]);
+		if (count == NULL || PyDict_SetItemString(gres, summary->gres_names[g], count) < 0)
+			Py_CLEAR(gres);
+		Py_XDECREF(count);
+	}
+	for (int f = 0; features && f < node_index.feature_count; ++f)
+	{
+		if (summary->feature_nodes[f] == 0)
+			continue;
+		PyObject *count = PyLong_FromUnsignedLong(summary->feature_nodes[f]);
+		if (count == NULL || PyDict_SetItemString(features, node_index.features[f], count) < 0)
+			Py_CLEAR(features);
+		Py_XDECREF(count);
+	}
+	for (int i = 0; partitions && i < node_index.partition_count; ++i)
+	{
+		if (part >= 0 && i != part)
+			continue;
+		PyObject *name = PyUnicode_FromString(node_index.partitions[i]);
+		if (name == NULL || PyList_Append(partitions, name) < 0)
+			Py_CLEAR(partitions);
+		Py_XDECREF(name);
+	}
+
+	if (gres && features && partitions)
+		result = Py_BuildValue("{s:i,s:O,s:O,s:O}", "nodes", summary->nodes, "features", features, "gres", gres,
+							   "partitions", partitions);
+	Py_XDECREF(gres);
+	Py_XDECREF(features);
+	Py_XDECREF(partitions);
+	return result;
+}
+
+/*
+ * Parse a decimal index at ``*p``, advancing it. Return false if there is
+ * no number or it does not fit 32 bits.
+ */
+static bool parse_array_number(const char **p, uint32_t *value)
+{
+	const char *start = *p;
+	uint64_t v = 0;
+	while (isdigit((unsigned char)**p))
+	{
+		v = v * 10 + (**p - '0');
+		if (v > UINT32_MAX)
+			return false;
+		++*p;
+	}
+	*value = v;
+	return *p != start;
+}
+
+static void free_constraint(struct constraint *c)
+{
+	for (int i = 0; i < c->name_count; ++i)
+		xfree(c->names[i]);
+	xfree(c->names);
+	xfree(c->ops);
+	xfree(c->feature_ids);
+	xfree(c->str);
+	memset(c, 0, sizeof(*c));
+}
+
+static void constraint_cache_flush(void)
+{
+	for (int i = 0; i < CONSTRAINT_CACHE_SIZE; ++i)
+		free_constraint(&constraint_cache[i]);
+}
+
+static bool parse_constraint_or(const char **p, struct constraint *c, int depth);
+
+static void skip_blanks(const char **p)
+{
+	while (isspace((unsigned char)**p))
+		++*p;
+}
+
+static void emit_constraint_op(struct constraint *c, enum constraint_opcode opcode, int name)
+{
+	xrealloc(c->ops, (c->op_count + 1) * sizeof(struct constraint_op));
+	c->ops[c->op_count].opcode = opcode;
+	c->ops[c->op_count].name = name;
+	++c->op_count;
+}
+
+/*
+ * factor := '!' factor | '(' or ')' | '[' or ']' | name ['*' count]
+ */
+static bool parse_constraint_factor(const char **p, struct constraint *c, int depth)
+{
+	skip_blanks(p);
+	if ((**p == '!' || **p == '(' || **p == '[') && depth >= CONSTRAINT_MAX_DEPTH)
+	{
+		PyErr_Format(PyExc_ValueError, "constraint nested more than %d levels deep", CONSTRAINT_MAX_DEPTH);
+		return false;
+	}
+	if (**p == '!')
+	{
+		++*p;
+		if (!parse_constraint_factor(p, c, depth + 1))
+			return false;
+		emit_constraint_op(c, CONSTRAINT_NOT, 0);
+		return true;
+	}
+	if (**p == '(' || **p == '[')
+	{
+		char close = **p == '(' ? ')' : ']';
+		++*p;
+		if (!parse_constraint_or(p, c, depth + 1))
+			return false;
+		skip_blanks(p);
+		if (**p != close)
+			return false;
+		++*p;
+		return true;
+	}
+
+	size_t len = strcspn(*p, "&|!()[]* \t\n");
+	if (len == 0)
+		return false;
+	emit_constraint_op(c, CONSTRAINT_FEATURE, intern_name(&c->names, NULL, &c->name_count, *p, len));
+	*p += len;
+
+	skip_blanks(p);
+	if (**p == '*')
+	{
+		uint32_t count;
+		++*p;
+		if (!parse_array_number(p, &count) || count == 0)
+			return false;
+		if (count > c->min_nodes)
+			c->min_nodes = count;
+	}
+	return true;
+}
+
+/*
+ * and := factor ('&' factor)*
+ */
+static bool parse_constraint_and(const char **p, struct constraint *c, int depth)
+{
+	if (!parse_constraint_factor(p, c, depth))
+		return false;
+	for (skip_blanks(p); **p == '&'; skip_blanks(p))
+	{
+		++*p;
+		if (!parse_constraint_factor(p, c, depth))
+			return false;
+		emit_constraint_op(c, CONSTRAINT_AND, 0);
+	}
+	return true;
+}
+
+/*
+ * or := and ('|' and)*
+ */
+static bool parse_constraint_or(const char **p, struct constraint *c, int depth)
+{
+	if (!parse_constraint_and(p, c, depth))
+		return false;
+	for (skip_blanks(p); **p == '|'; skip_blanks(p))
+	{
+		++*p;
+		if (!parse_constraint_and(p, c, depth))
+			return false;
+		emit_constraint_op(c, CONSTRAINT_OR, 0);
+	}
+	return true;
+}
+
+/*
+ * Return the compiled constraint for ``str``, compiling it unless cached.
+ * Return NULL and set a Python error if the expression is invalid.
+ */
+static struct constraint *lookup_constraint(const char *str)
+{
+	uint32_t hash = hash_string(str);
+	struct constraint *victim = &constraint_cache[0];
+
+	for (int i = 0; i < CONSTRAINT_CACHE_SIZE; ++i)
+	{
+		struct constraint *c = &constraint_cache[i];
+		if (c->str && c->hash == hash && !strcmp(c->str, str))
+		{
+			c->last_used = ++constraint_cache_clock;
+			return c;
+		}
+		if (c->last_used < victim->last_used)
+			victim = c;
+	}
+
+	struct constraint parsed;
+	memset(&parsed, 0, sizeof(parsed));
+	const char *p = str;
+	bool ok = parse_constraint_or(&p, &parsed, 0);
+	skip_blanks(&p);
+	if (!ok || *p != '\0')
+	{
+		free_constraint(&parsed);
+		if (!PyErr_Occurred())
+			PyErr_Format(PyExc_ValueError, "invalid constraint \"%s\"", str);
+		return NULL;
+	}
+
+	free_constraint(victim);
+	*victim = parsed;
+	victim->hash = hash;
+	victim->str = xstrdup(str);
+	victim->last_used = ++constraint_cache_clock;
+	victim->feature_ids = xcalloc(parsed.name_count + 1, sizeof(int));
+	return victim;
+}
+
+/*
+ * Return the number of nodes of partition ``part`` (-1 for all) whose
+ * features satisfy ``c``. The node index is up to date.
+ */
+static uint32_t count_constraint_nodes(struct constraint *c, int part)
+{
+	if (c->resolved_version != node_index_version)
+	{
+		for (int i = 0; i < c->name_count; ++i)
+		{
+			c->feature_ids[i] = -1;
+			for (int f = 0; f < node_index.feature_count; ++f)
+			{
+				if (!strcmp(node_index.features[f], c->names[i]))
+				{
+					c->feature_ids[i] = f;
+					break;
+				}
+			}
+		}
+		c->resolved_version = node_index_version;
+	}
+
+	bool *stack = xcalloc(c->op_count + 1, sizeof(bool));
+	uint32_t count = 0;
+	for (int node = 0; node < node_index.node_count; ++node)
+	{
+		if (part >= 0 && !BIT_TEST(node_index.node_partitions, node_index.partition_words, node, part))
+			continue;
+
+		int top = 0;
+		for (int i = 0; i < c->op_count; ++i)
+		{
+			const struct constraint_op *op = &c->ops[i];
+			switch (op->opcode)
+			{
+			case CONSTRAINT_FEATURE:
+			{
+				int f = c->feature_ids[op->name];
+				stack[top++] = f >= 0 && BIT_TEST(node_index.node_features, node_index.feature_words, node, f);
+				break;
+			}
+			case CONSTRAINT_AND:
+				--top;
+				stack[top - 1] = stack[top - 1] && stack[top];
+				break;
+			case CONSTRAINT_OR:
+				--top;
+				stack[top - 1] = stack[top - 1] || stack[top];
+				break;
+			case CONSTRAINT_NOT:
+				stack[top - 1] = !stack[top - 1];
+				break;
+			}
+		}
+		count += stack[0];
+	}
+	xfree(stack);
+	return count;
+}
+
+/*
+ * Return ``(satisfiable, nodes)`` for a constraint expression such as
+ * ``a100&(ib|roce)`` on a partition, or the whole cluster. ``nodes`` is the
+ * number of nodes whose features satisfy the expression on their own; it
+ * is satisfiable if that is at least one, or the largest ``feature*N``
+ * count. Return None for an unknown partition.
+ */
+static PyObject *py_slurm_check_constraint(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"constraint", "partition", NULL};
+	const char *str, *partition = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|z", keywords, &str, &partition))
+		return NULL;
+
+	if (current_job_desc == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "nodes can only be read while a job is evaluated");
+		return NULL;
+	}
+
+	struct constraint *c = lookup_constraint(str);
+	if (c == NULL)
+		return NULL;
+
+	node_index_refresh();
+	int part = node_index_partition(partition);
+	if (part == -2)
+		Py_RETURN_NONE;
+
+	uint32_t nodes = count_constraint_nodes(c, part);
+	uint32_t needed = c->min_nodes ? c->min_nodes : 1;
+	return Py_BuildValue("(OI)", nodes >= needed ? Py_True : Py_False, nodes);
+}
+
+/*
+ * A single license of a license string such as ``matlab:2,ansys@db:1``
+ */
+struct license_request
+{
+	char *name;
+	uint32_t count;
+};
+
+/*
+ * Parse a license string, separated by ``,`` or, for alternatives, ``|``.
+ * The count follows ``:``, or ``=`` and ``*`` as also accepted in
+ * slurm.conf, and defaults to 1. Return the number of licenses, or -1 if
+ * the string is invalid.
+ */
+static int parse_license_string(const char *str, struct license_request **reqs, bool *any)
+{
+	const char *p = str;
+	char separator = 0;
+	int count = 0;
+
+	*reqs = NULL;
+	*any = false;
+	for (;;)
+	{
+		size_t len = strcspn(p, ":=*,|");
+		uint32_t n = 1;
+		if (len == 0)
+			goto invalid;
+		xrealloc(*reqs, (count + 1) * sizeof(struct license_request));
+		(*reqs)[count].name = xstrndup(p, len);
+		p += len;
+		if (*p == ':' || *p == '=' || *p == '*')
+		{
+			++p;
+			if (!parse_array_number(&p, &n))
+			{
+				++count;
+				goto invalid;
+			}
+		}
+		(*reqs)[count++].count = n;
+
+		if (*p == '\0')
+			break;
+		if ((*p != ',' && *p != '|') || (separator && *p != separator))
+			goto invalid;
+		separator = *p++;
+	}
+
+	*any = separator == '|';
+	return count;
+
+invalid:
+	for (int i = 0; i < count; ++i)
+		xfree((*reqs)[i].name);
+	xfree(*reqs);
+	return -1;
+}
+
+static void free_license_requests(int count, struct license_request *reqs)
+{
+	for (int i = 0; i < count; ++i)
+		xfree(reqs[i].name);
+	xfree(reqs);
+}
+
+/*
+ * Return ``{"any", "licenses"}`` for a license string, each license as
+ * ``{"name", "count"}``, or None for None. With ``validate``, every license
+ * also carries its ``total`` configured in slurm.conf (None if it is not
+ * configured) and ``valid`` tells whether the requests fit their totals.
+ * Unless they are alternatives, requests of the same license are added up
+ * first, as ``matlab:1,matlab:2`` needs 3. Licenses only known to slurmdbd
+ * are not configured in this sense.
+ */
+static PyObject *py_slurm_parse_licenses(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"licenses", "validate", NULL};
+	PyObject *arg;
+	int validate = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", keywords, &arg, &validate))
+		return NULL;
+
+	if (arg == Py_None)
+		Py_RETURN_NONE;
+
+	const char *str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	struct license_request *reqs, *configured = NULL;
+	bool any, configured_any;
+	int count = parse_license_string(str, &reqs, &any);
+	if (count < 0)
+	{
+		PyErr_Format(PyExc_ValueError, "invalid licenses \"%s\"", str);
+		return NULL;
+	}
+
+	// The configuration is read with the config read lock held
+	int configured_count = 0;
+	if (validate && controller_conf.licenses)
+		configured_count = parse_license_string(controller_conf.licenses, &configured, &configured_any);
+
+	PyObject *list = PyList_New(count);
+	int fitting = 0;
+	for (int i = 0; list && i < count; ++i)
+	{
+		PyObject *entry = Py_BuildValue("{s:s,s:I}", "name", reqs[i].name, "count", reqs[i].count);
+		if (entry && validate)
+		{
+			int j = 0;
+			while (j < configured_count && strcmp(configured[j].name, reqs[i].name))
+				++j;
+			PyObject *total = j < configured_count ? PyLong_FromUnsignedLong(configured[j].count) : (Py_INCREF(Py_None), Py_None);
+			if (total == NULL || PyDict_SetItemString(entry, "total", total) < 0)
+				Py_CLEAR(entry);
+			Py_XDECREF(total);
+			uint64_t requested = reqs[i].count;
+			for (int k = 0; !any && k < count; ++k)
+			{
+				if (k != i && !strcmp(reqs[k].name, reqs[i].name))
+					requested += reqs[k].count;
+			}
+			if (j < configured_count && configured[j].count >= requested)
+				++fitting;
+		}
+		if (entry == NULL)
+		{
+			Py_CLEAR(list);
+			break;
+		}
+		PyList_SET_ITEM(list, i, entry);
+	}
+	free_license_requests(count, reqs);
+	free_license_requests(configured_count, configured);
+
+	if (list == NULL)
+		return NULL;
+
+	// Any of the alternatives, or all of the licenses
+	bool valid = any ? fitting > 0 : fitting == count;
+
+	PyObject *dict;
+	if (validate)
+		dict = Py_BuildValue("{s:O,s:O,s:O}", "any", any ? Py_True : Py_False, "licenses", list, "valid",
+							 valid ? Py_True : Py_False);
+	else
+		dict = Py_BuildValue("{s:O,s:O}", "any", any ? Py_True : Py_False, "licenses", list);
+	Py_DECREF(list);
+	return dict;
+}
+
+/*
+ * Settings of the in-memory slurm.conf exposed by ``slurm.config()``, named
+ * as in slurm.conf
+ */
+enum conf_kind
+{
+	CONF_STRING,
+	CONF_UINT, // unsigned integer of the member's width
+	CONF_MEM_PER_CPU,
+	CONF_MEM_PER_NODE
+};
+
+struct conf_field
+{
+	const char *name;
+	enum conf_kind kind;
+	size_t offset;
+	size_t size;
+};
+
+#define CONF_FIELD(name, kind, member) \
+	{name, kind, offsetof(__typeof__(controller_conf), member), sizeof(controller_conf.member)}
+
+static const struct conf_field conf_fields[] = {
+		CONF_FIELD("ClusterName", CONF_STRING, cluster_name),
+		CONF_FIELD("DefMemPerCPU", CONF_MEM_PER_CPU, def_mem_per_cpu),
+		CONF_FIELD("DefMemPerNode", CONF_MEM_PER_NODE, def_mem_per_cpu),
+		CONF_FIELD("MaxMemPerCPU", CONF_MEM_PER_CPU, max_mem_per_cpu),
+		CONF_FIELD("MaxMemPerNode", CONF_MEM_PER_NODE, max_mem_per_cpu),
+		CONF_FIELD("MaxArraySize", CONF_UINT, max_array_sz),
+		CONF_FIELD("MaxJobCount", CONF_UINT, max_job_cnt),
+		CONF_FIELD("MaxTasksPerNode", CONF_UINT, max_tasks_per_node),
+		CONF_FIELD("FirstJobId", CONF_UINT, first_job_id),
+		CONF_FIELD("MaxJobId", CONF_UINT, max_job_id),
+		CONF_FIELD("MinJobAge", CONF_UINT, min_job_age),
+		CONF_FIELD("KillWait", CONF_UINT, kill_wait),
+		CONF_FIELD("Licenses", CONF_STRING, licenses),
+		CONF_FIELD("PriorityType", CONF_STRING, priority_type),
+		CONF_FIELD("SchedulerParameters", CONF_STRING, sched_params),
+		CONF_FIELD("SelectType", CONF_STRING, select_type),
+		{NULL}};
+
+static uint64_t conf_get_uint(const char *base, size_t size)
+{
+	switch (size)
+	{
+	case 1:
+		return *(const uint8_t *)base;
+	case 2:
+		return *(const uint16_t *)base;
+	case 4:
+		return *(const uint32_t *)base;
+	default:
+		return *(const uint64_t *)base;
+	}
+}
+
+/*
+ * Return a setting of the controller's configuration. Memory settings are
+ * None unless set in the unit of their name.
+ */
+static PyObject *conf_field_to_python(const struct conf_field *field)
+{
+	const char *base = (const char *)&controller_conf + field->offset;
+	uint64_t memory;
+
+	switch (field->kind)
+	{
+	case CONF_STRING:
+		if (*(char **)base == NULL)
+			Py_RETURN_NONE;
+		return PyUnicode_FromString(*(char **)base);
+	case CONF_UINT:
+		return PyLong_FromUnsignedLongLong(conf_get_uint(base, field->size));
+	case CONF_MEM_PER_CPU:
+	case CONF_MEM_PER_NODE:
+		memory = conf_get_uint(base, field->size);
+		if (memory == NO_VAL64 || !(memory & ~MEM_PER_CPU) ||
+			((memory & MEM_PER_CPU) != 0) != (field->kind == CONF_MEM_PER_CPU))
+			Py_RETURN_NONE;
+		return PyLong_FromUnsignedLongLong(memory & ~MEM_PER_CPU);
+	}
+
+	PyErr_BadInternalCall();
+	return NULL;
+}
+
+/*
+ * Return a setting of the in-memory slurm.conf by its slurm.conf name, or
+ * all of them as a dict. Nothing is read from disk.
+ */
+static PyObject *py_slurm_config(PyObject *self, PyObject *args)
+{
+	const char *name = NULL;
+	if (!PyArg_ParseTuple(args, "|z", &name))
+		return NULL;
+
+	// The configuration is only read with the config read lock held
+	if (current_job_desc == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "the configuration can only be read while a job is evaluated");
+		return NULL;
+	}
+
+	if (name)
+	{
+		for (const struct conf_field *field = conf_fields; field->name; ++field)
+		{
+			if (!xstrcasecmp(field->name, name))
+				return conf_field_to_python(field);
+		}
+		PyErr_Format(PyExc_KeyError, "%s", name);
+		return NULL;
+	}
+
+	PyObject *dict = PyDict_New();
+	for (const struct conf_field *field = conf_fields; dict && field->name; ++field)
+	{
+		PyObject *value = conf_field_to_python(field);
+		if (value == NULL || PyDict_SetItemString(dict, field->name, value) < 0)
+			Py_CLEAR(dict);
+		Py_XDECREF(value);
+	}
+	return dict;
+}
+
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(21, 0, 0)
+/*
+ * Split a command line into words as a POSIX shell would, without
+ * expansions. An unclosed quote extends to the end of the line.
+ */
+static int split_command_line(const char *line, char ***words)
+{
+	const char *p = line;
+	int count = 0;
+
+	*words = NULL;
+	for (;;)
+	{
+		while (isspace((unsigned char)*p))
+			++p;
+		if (*p == '\0')
+			return count;
+
+		char *word = xmalloc(strlen(p) + 1), *w = word;
+		char quote = 0;
+		for (; *p && (quote || !isspace((unsigned char)*p)); ++p)
+		{
+			if (quote == '\'')
+			{
+				if (*p == '\'')
+					quote = 0;
+				else
+					*w++ = *p;
+			}
+			else if (*p == '\\' && p[1] && (!quote || strchr("\"\\$`", p[1])))
+			{
+				*w++ = *++p;
+			}
+			else if (*p == '"')
+			{
+				quote = quote ? 0 : '"';
+			}
+			else if (*p == '\'' && !quote)
+			{
+				quote = '\'';
+			}
+			else
+			{
+				*w++ = *p;
+			}
+		}
+		*w = '\0';
+
+		xrealloc(*words, (count + 1) * sizeof(char *));
+		(*words)[count++] = word;
+	}
+}
+
+/*
+ * Long names of the short options of sbatch, salloc and srun
+ */
+static const char *short_option_names[128] = {
+		['A'] = "account", ['a'] = "array", ['B'] = "extra-node-info", ['b'] = "begin", ['C'] = "constraint",
+		['c'] = "cpus-per-task", ['D'] = "chdir", ['d'] = "dependency", ['E'] = "preserve-env", ['e'] = "error",
+		['F'] = "nodefile", ['G'] = "gpus", ['H'] = "hold", ['h'] = "help", ['I'] = "immediate", ['i'] = "input",
+		['J'] = "job-name", ['K'] = "kill-on-bad-exit", ['k'] = "no-kill", ['L'] = "licenses", ['l'] = "label",
+		['M'] = "clusters", ['m'] = "distribution", ['N'] = "nodes", ['n'] = "ntasks", ['O'] = "overcommit",
+		['o'] = "output", ['p'] = "partition", ['Q'] = "quiet", ['q'] = "qos", ['r'] = "relative",
+		['S'] = "core-spec", ['s'] = "oversubscribe", ['T'] = "threads", ['t'] = "time", ['u'] = "unbuffered",
+		['V'] = "version", ['v'] = "verbose", ['W'] = "wait", ['w'] = "nodelist", ['X'] = "disable-status",
+		['x'] = "exclude"};
+
+/*
+ * Options that take no value, or only an attached one such as
+ * ``--exclusive=user``
+ */
+static const char *flag_options[] = {
+		"contiguous", "disable-status", "exclusive", "get-user-env", "help", "hold", "ignore-pbs", "immediate",
+		"kill-on-bad-exit", "label", "no-kill", "no-requeue", "overcommit", "oversubscribe", "parsable",
+		"preserve-env", "propagate", "pty", "quiet", "reboot", "requeue", "spread-job", "test-only", "unbuffered",
+		"usage", "use-min-nodes", "verbose", "version", "wait", "x11", NULL};
+
+static bool is_flag_option(const char *name)
+{
+	for (const char **flag = flag_options; *flag; ++flag)
+	{
+		if (!strcmp(*flag, name))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Set ``options[name]`` to ``value``, or None if NULL
+ */
+static int set_option(PyObject *options, const char *name, size_t len, const char *value)
+{
+	PyObject *key = PyUnicode_DecodeUTF8(name, len, "surrogateescape");
+	PyObject *val = value ? PyUnicode_DecodeUTF8(value, strlen(value), "surrogateescape") : (Py_INCREF(Py_None), Py_None);
+	int rc = (key && val) ? PyDict_SetItem(options, key, val) : -1;
+	Py_XDECREF(key);
+	Py_XDECREF(val);
+	return rc;
+}
+
+/*
+ * Return ``{"command", "options", "arguments"}`` for a command line. The
+ * options given before the script or program are keyed by their long
+ * names, with None for flags; the last occurrence wins.
+ */
+static PyObject *parse_submit_line(const char *line)
+{
+	char **words;
+	int count = split_command_line(line, &words);
+	PyObject *options = PyDict_New(), *arguments = PyList_New(0), *result = NULL;
+	int i = 1;
+
+	for (; options && i < count; ++i)
+	{
+		const char *word = words[i];
+		if (!strcmp(word, "--"))
+		{
+			++i;
+			break;
+		}
+		if (word[0] != '-' || word[1] == '\0')
+			break;
+
+		int rc = 0;
+		if (word[1] == '-')
+		{
+			const char *name = word + 2, *eq = strchr(name, '=');
+			size_t len = eq ? (size_t)(eq - name) : strlen(name);
+			const char *value = eq ? eq + 1 : NULL;
+			if (value == NULL && !is_flag_option(name) && i + 1 < count)
+				value = words[++i];
+			rc = set_option(options, name, len, value);
+		}
+		else
+		{
+			// Bundled flags such as -vv or -Hv, then an option with a value
+			for (const char *c = word + 1; *c && rc == 0; ++c)
+			{
+				const char *name = (unsigned char)*c < 128 ? short_option_names[(unsigned char)*c] : NULL;
+				size_t len = name ? strlen(name) : 1;
+				if (name == NULL)
+					name = c;
+				if (is_flag_option(name) && strcmp(name, "immediate") && strcmp(name, "kill-on-bad-exit"))
+				{
+					rc = set_option(options, name, len, NULL);
+					continue;
+				}
+				const char *value = c[1] ? c + 1 : (i + 1 < count && !is_flag_option(name) ? words[++i] : NULL);
+				rc = set_option(options, name, len, value);
+				break;
+			}
+		}
+		if (rc < 0)
+			Py_CLEAR(options);
+	}
+
+	for (; arguments && i < count; ++i)
+	{
+		PyObject *arg = PyUnicode_DecodeUTF8(words[i], strlen(words[i]), "surrogateescape");
+		if (arg == NULL || PyList_Append(arguments, arg) < 0)
+			Py_CLEAR(arguments);
+		Py_XDECREF(arg);
+	}
+
+	if (options && arguments)
+	{
+		PyObject *command = count > 0 ? PyUnicode_DecodeUTF8(words[0], strlen(words[0]), "surrogateescape")
+									  : (Py_INCREF(Py_None), Py_None);
+		if (command)
+			result = Py_BuildValue("{s:O,s:O,s:O}", "command", command, "options", options, "arguments", arguments);
+		Py_XDECREF(command);
+	}
+	Py_XDECREF(options);
+	Py_XDECREF(arguments);
+	for (int j = 0; j < count; ++j)
+		xfree(words[j]);
+	xfree(words);
+	return result;
+}
+#endif
+
+/*
+ * Return the options explicitly given on the command line of the
+ * submission being evaluated, parsed from ``submit_line`` once per
+ * submission, or None if there is no submit line
+ */
+static PyObject *py_slurm_submit_options(PyObject *self, PyObject *args)
+{
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(21, 0, 0)
+	if (current_job_desc == NULL)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "job descriptor is no longer being evaluated");
+		return NULL;
+	}
+	if (current_job_desc->submit_line == NULL)
+		Py_RETURN_NONE;
+
+	if (submit_options == NULL || submit_options_generation != current_generation)
+	{
+		Py_CLEAR(submit_options);
+		submit_options = parse_submit_line(current_job_desc->submit_line);
+		if (submit_options == NULL)
+			return NULL;
+		submit_options_generation = current_generation;
+	}
+
+	Py_INCREF(submit_options);
+	return submit_options;
+#else
+	Py_RETURN_NONE;
+#endif
+}
+
+/*
+ * Return the job script of ``obj``, which is either the job descriptor being
+ * evaluated, whose C buffer is read directly, another mapping with a
+ * ``script`` entry, or the script itself as a str. ``*owner`` holds any
+ * reference the returned buffer depends on.
+ */
+static const char *script_of(PyObject *obj, Py_ssize_t *len, PyObject **owner)
+{
+	*owner = NULL;
+	const char *str;
+	if (job_descriptor_script(obj, &str, len))
+		return str;
+
+	if (PyUnicode_Check(obj))
+		return PyUnicode_AsUTF8AndSize(obj, len);
+
+	PyObject *script = PyMapping_GetItemString(obj, "script");
+	if (script == NULL)
+		return NULL;
+	if (script == Py_None)
+	{
+		Py_DECREF(script);
+		*len = 0;
+		return "";
+	}
+	str = PyUnicode_AsUTF8AndSize(script, len);
+	if (str == NULL)
+	{
+		Py_DECREF(script);
+		return NULL;
+	}
+	*owner = script;
+	return str;
+}
+
+/*
+ * Append the option ``token`` of a directive line to ``list``, taking its
+ * value from the next token if it is not attached. Return the number of
+ * tokens consumed, or -1 on error.
+ */
+static int append_directive(PyObject *list, const char **tokens, const size_t *lengths, int count)
+{
+	const char *token = tokens[0];
+	size_t len = lengths[0];
+	const char *value = NULL;
+	size_t value_len = 0;
+	int used = 1;
+
+	if (len > 2 && token[0] == '-' && token[1] == '-')
+	{
+		token += 2;
+		len -= 2;
+		const char *eq = memchr(token, '=', len);
+		if (eq)
+		{
+			value = eq + 1;
+			value_len = len - (eq + 1 - token);
+			len = eq - token;
+		}
+	}
+	else if (len > 1 && token[0] == '-')
+	{
+		token += 1;
+		len -= 1;
+		if (len > 1)
+		{
+			value = token + 1;
+			value_len = len - 1;
+			len = 1;
+		}
+	}
+
+	if (value == NULL && token != tokens[0] && count > 1 && tokens[1][0] != '-')
+	{
+		value = tokens[1];
+		value_len = lengths[1];
+		used = 2;
+	}
+
+	if (value && value_len >= 2 && (value[0] == '"' || value[0] == '\'') && value[value_len - 1] == value[0])
+	{
+		++value;
+		value_len -= 2;
+	}
+
+	PyObject *name = PyUnicode_DecodeUTF8(token, len, "surrogateescape");
+	PyObject *val = value ? PyUnicode_DecodeUTF8(value, value_len, "surrogateescape") : (Py_INCREF(Py_None), Py_None);
+	PyObject *pair = (name && val) ? PyTuple_Pack(2, name, val) : NULL;
+	Py_XDECREF(name);
+	Py_XDECREF(val);
+	if (pair == NULL || PyList_Append(list, pair) < 0)
+	{
+		Py_XDECREF(pair);
+		return -1;
+	}
+	Py_DECREF(pair);
+	return used;
+}
+
+#define DIRECTIVE_MAX_TOKENS 64
+
+/*
+ * Collect the ``#SBATCH`` directives of a job script as sbatch does, up to
+ * the first line that is neither blank nor a comment
+ */
+static PyObject *scan_script_directives(const char *script, size_t len)
+{
+	static const char magic[] = "#SBATCH";
+	const size_t magic_len = sizeof(magic) - 1;
+	const char *end = script + len;
+	PyObject *list = PyList_New(0);
+	if (list == NULL)
+		return NULL;
+
+	for (const char *line = script; line < end;)
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+
+		const char *p = line;
+		while (p < eol && isspace((unsigned char)*p))
+			++p;
+		if (p < eol && *p != '#')
+			break;
+
+		if ((size_t)(eol - line) > magic_len && !memcmp(line, magic, magic_len) &&
+			isspace((unsigned char)line[magic_len]))
+		{
+			const char *tokens[DIRECTIVE_MAX_TOKENS];
+			size_t lengths[DIRECTIVE_MAX_TOKENS];
+			int count = 0;
+
+			// Split on blanks, honouring quotes, until a trailing comment
+			p = line + magic_len;
+			while (count < DIRECTIVE_MAX_TOKENS)
+			{
+				while (p < eol && isspace((unsigned char)*p))
+					++p;
+				if (p == eol || *p == '#')
+					break;
+				const char *start = p;
+				char quote = 0;
+				for (; p < eol && (quote || !isspace((unsigned char)*p)); ++p)
+				{
+					if (quote && *p == quote)
+						quote = 0;
+					else if (!quote && (*p == '"' || *p == '\''))
+						quote = *p;
+				}
+				tokens[count] = start;
+				lengths[count] = p - start;
+				++count;
+			}
+
+			for (int i = 0; i < count;)
+			{
+				int used = append_directive(list, tokens + i, lengths + i, count - i);
+				if (used < 0)
+				{
+					Py_DECREF(list);
+					return NULL;
+				}
+				i += used;
+			}
+		}
+
+		line = eol + 1;
+	}
+
+	return list;
+}
+
+/*
+ * Return the ``#SBATCH`` directives of a job script as ``(name, value)``
+ * pairs, e.g. ``("time", "10")`` for ``--time=10`` and ``("N", "2")`` for
+ * ``-N 2``. The value is None for flags such as ``--exclusive``.
+ */
+static PyObject *py_slurm_script_directives(PyObject *self, PyObject *arg)
+{
+	Py_ssize_t len;
+	PyObject *owner;
+	const char *script = script_of(arg, &len, &owner);
+	if (script == NULL)
+		return NULL;
+
+	PyObject *directives = scan_script_directives(script, len);
+	Py_XDECREF(owner);
+	return directives;
+}
+
+/*
+ * Load up to 8 bytes as a little-endian word, whatever the byte order of the
+ * host. Compilers turn the loop into a single load on little-endian hosts.
+ */
+static uint64_t load_le64(const char *data, size_t len)
+{
+	uint64_t word = 0;
+	for (size_t b = 0; b < len; ++b)
+		word |= (uint64_t)(unsigned char)data[b] << (8 * b);
+	return word;
+}
+
+/*
+ * A fast 64 bit non-cryptographic hash, reading 8 bytes at a time. The
+ * words are read as little-endian, so the values are the same on every
+ * controller and across restarts, and policies may persist them.
+ */
+static uint64_t hash_bytes(const char *data, size_t len)
+{
+	const uint64_t prime = 0x9e3779b97f4a7c15ull;
+	uint64_t hash = len * prime;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		hash = (hash ^ load_le64(data + i, 8)) * prime;
+		hash ^= hash >> 29;
+	}
+	if (i < len)
+		hash = (hash ^ load_le64(data + i, len - i)) * prime;
+
+	// The murmur3 finalizer
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/*
+ * Return a 64 bit hash of the job script, computed once per submission for
+ * the job descriptor being evaluated
+ */
+static PyObject *py_slurm_script_hash(PyObject *self, PyObject *arg)
+{
+	Py_ssize_t len;
+	PyObject *owner;
+	const char *script = script_of(arg, &len, &owner);
+	if (script == NULL)
+		return NULL;
+
+	uint64_t hash;
+	if (owner == NULL && current_job_desc != NULL && script == current_job_desc->script)
+	{
+		if (script_hash_generation != current_generation)
+		{
+			script_hash_value = hash_bytes(script, len);
+			script_hash_generation = current_generation;
+		}
+		hash = script_hash_value;
+	}
+	else
+	{
+		hash = hash_bytes(script, len);
+	}
+	Py_XDECREF(owner);
+
+	return PyLong_FromUnsignedLongLong(hash);
+}
+
+/*
+ * SHA-256 (FIPS 180-4). Done natively as ``hashlib`` does not survive the
+ * interpreter restarts between submissions.
+ */
+static const uint32_t sha256_k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const unsigned char *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+			   (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (int i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; ++i)
+	{
+		uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/*
+ * Write the hex digest of ``len`` bytes of ``data`` to ``hex``
+ */
+static void sha256_hex(const char *data, size_t len, char hex[65])
+{
+	uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+						 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	const unsigned char *p = (const unsigned char *)data;
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64)
+		sha256_block(state, p + i);
+
+	// The last block(s): remaining bytes, 0x80, zeros and the length in bits
+	unsigned char tail[128] = {0};
+	size_t rest = len - i;
+	memcpy(tail, p + i, rest);
+	tail[rest] = 0x80;
+	size_t tail_len = rest < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t)len * 8;
+	for (int j = 0; j < 8; ++j)
+		tail[tail_len - 1 - j] = bits >> (8 * j);
+	sha256_block(state, tail);
+	if (tail_len == 128)
+		sha256_block(state, tail + 64);
+
+	for (int j = 0; j < 8; ++j)
+		sprintf(hex + j * 8, "%08x", state[j]);
+}
+
+/*
+ * Return the SHA-256 hex digest of the job script, computed on demand and
+ * at most once per submission for the job descriptor being evaluated
+ */
+static PyObject *py_slurm_script_sha256(PyObject *self, PyObject *arg)
+{
+	Py_ssize_t len;
+	PyObject *owner;
+	const char *script = script_of(arg, &len, &owner);
+	if (script == NULL)
+		return NULL;
+
+	char hex[65];
+	if (owner == NULL && current_job_desc != NULL && script == current_job_desc->script)
+	{
+		if (script_sha256_generation != current_generation)
+		{
+			sha256_hex(script, len, script_sha256_value);
+			script_sha256_generation = current_generation;
+		}
+		memcpy(hex, script_sha256_value, sizeof(hex));
+	}
+	else
+	{
+		sha256_hex(script, len, hex);
+	}
+	Py_XDECREF(owner);
+
+	return PyUnicode_FromString(hex);
+}
+
+static void free_pattern_set(struct pattern_set *set)
+{
+	for (uint32_t i = 0; i < set->count; ++i)
+		xfree(set->patterns[i]);
+	xfree(set->patterns);
+	xfree(set->delta);
+	xfree(set->match);
+	xfree(set->next_match);
+	xfree(set);
+}
+
+/*
+ * Free the compiled pattern sets beyond the ``keep`` most recently used, or
+ * beyond PATTERN_CACHE_BYTES of tables
+ */
+static void pattern_cache_trim(int keep)
+{
+	struct pattern_set **link = &pattern_cache;
+	size_t bytes = 0;
+	for (int i = 0; *link && i < keep && bytes + (*link)->bytes <= PATTERN_CACHE_BYTES; ++i)
+	{
+		bytes += (*link)->bytes;
+		link = &(*link)->next;
+	}
+
+	struct pattern_set *set = *link;
+	*link = NULL;
+	while (set)
+	{
+		struct pattern_set *next = set->next;
+		free_pattern_set(set);
+		set = next;
+	}
+}
+
+/*
+ * Build the automaton of ``set->patterns``. Return false if it would need
+ * more than PATTERN_MAX_STATES states.
+ */
+static bool build_pattern_set(struct pattern_set *set)
+{
+	uint32_t max_states = 1;
+	for (uint32_t i = 0; i < set->count; ++i)
+		max_states += strlen(set->patterns[i]);
+	if (max_states > PATTERN_MAX_STATES)
+		return false;
+
+	set->classes = 1;
+	for (uint32_t i = 0; i < set->count; ++i)
+	{
+		for (const unsigned char *p = (const unsigned char *)set->patterns[i]; *p; ++p)
+		{
+			unsigned char c = set->ignore_case ? tolower(*p) : *p;
+			if (set->class_of[c] == 0)
+				set->class_of[c] = set->classes++;
+		}
+	}
+	for (int c = 0; set->ignore_case && c < 256; ++c)
+		set->class_of[c] = set->class_of[tolower(c)];
+
+	const uint32_t width = set->classes;
+	set->bytes = (size_t)max_states * (width * sizeof(uint32_t) + sizeof(int32_t) + sizeof(uint32_t));
+	set->delta = xcalloc((size_t)max_states * width, sizeof(uint32_t));
+	set->match = xcalloc(max_states, sizeof(int32_t));
+	set->next_match = xcalloc(max_states, sizeof(uint32_t));
+	set->match[0] = -1;
+	set->states = 1;
+
+	// The trie; a 0 transition is a missing edge as no edge leads to the root
+	for (uint32_t i = 0; i < set->count; ++i)
+	{
+		uint32_t state = 0;
+		for (const unsigned char *p = (const unsigned char *)set->patterns[i]; *p; ++p)
+		{
+			uint32_t *edge = &set->delta[(size_t)state * width + set->class_of[*p]];
+			if (*edge == 0)
+			{
+				*edge = set->states;
+				set->match[set->states++] = -1;
+			}
+			state = *edge;
+		}
+		if (set->match[state] < 0)
+			set->match[state] = i;
+	}
+
+	// Breadth first, completing each row from the row of its failure state
+	uint32_t *queue = xcalloc(set->states, sizeof(uint32_t));
+	uint32_t *fail = xcalloc(set->states, sizeof(uint32_t));
+	uint32_t head = 0, tail = 0;
+	for (uint32_t c = 0; c < width; ++c)
+	{
+		if (set->delta[c])
+			queue[tail++] = set->delta[c];
+	}
+	while (head < tail)
+	{
+		uint32_t state = queue[head++];
+		uint32_t *row = &set->delta[(size_t)state * width];
+		const uint32_t *fail_row = &set->delta[(size_t)fail[state] * width];
+		for (uint32_t c = 0; c < width; ++c)
+		{
+			uint32_t child = row[c];
+			if (child == 0)
+			{
+				row[c] = fail_row[c];
+				continue;
+			}
+			uint32_t suffix = fail_row[c];
+			fail[child] = suffix;
+			set->next_match[child] = set->match[suffix] >= 0 ? suffix : set->next_match[suffix];
+			queue[tail++] = child;
+		}
+	}
+	xfree(queue);
+	xfree(fail);
+
+	return true;
+}
+
+/*
+ * Return the compiled pattern set for a Python iterable of str, compiling it
+ * unless it is cached. Return NULL and set a Python error on failure.
+ */
+static struct pattern_set *lookup_pattern_set(PyObject *obj, bool ignore_case)
+{
+	PyObject *seq = PySequence_Fast(obj, "patterns must be an iterable of str");
+	if (seq == NULL)
+		return NULL;
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+	const char **patterns = xcalloc(count + 1, sizeof(char *));
+	uint32_t hash = ignore_case ? 1 : 0;
+	for (Py_ssize_t i = 0; i < count; ++i)
+	{
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		patterns[i] = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+		if (patterns[i] == NULL || patterns[i][0] == '\0')
+		{
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_ValueError, "patterns must be non-empty str");
+			xfree(patterns);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		hash = (hash * 31) ^ hash_string(patterns[i]);
+	}
+
+	struct pattern_set **link = &pattern_cache;
+	for (; *link; link = &(*link)->next)
+	{
+		struct pattern_set *set = *link;
+		if (set->hash != hash || set->ignore_case != ignore_case || set->count != count)
+			continue;
+		Py_ssize_t i = 0;
+		while (i < count && !strcmp(set->patterns[i], patterns[i]))
+			++i;
+		if (i < count)
+			continue;
+
+		// Move to the front
+		*link = set->next;
+		set->next = pattern_cache;
+		pattern_cache = set;
+		set->last_used = ++pattern_cache_clock;
+		xfree(patterns);
+		Py_DECREF(seq);
+		return set;
+	}
+
+	struct pattern_set *set = xmalloc(sizeof(*set));
+	memset(set, 0, sizeof(*set));
+	set->hash = hash;
+	set->ignore_case = ignore_case;
+	set->count = count;
+	set->patterns = xcalloc(count + 1, sizeof(char *));
+	for (Py_ssize_t i = 0; i < count; ++i)
+		set->patterns[i] = xstrdup(patterns[i]);
+	xfree(patterns);
+	Py_DECREF(seq);
+
+	if (!build_pattern_set(set))
+	{
+		free_pattern_set(set);
+		PyErr_Format(PyExc_ValueError, "patterns are too long, at most %d characters in total", PATTERN_MAX_STATES - 1);
+		return NULL;
+	}
+
+	set->last_used = ++pattern_cache_clock;
+	set->next = pattern_cache;
+	pattern_cache = set;
+	return set;
+}
+
+/*
+ * Mark in ``seen`` the patterns found in ``len`` bytes of ``str``, appending
+ * ``(field, pattern)`` to ``list`` for each one not seen before
+ */
+static int scan_pattern_set(const struct pattern_set *set, const char *str, size_t len, PyObject *field,
+							unsigned char *seen, PyObject *list)
+{
+	const unsigned char *p = (const unsigned char *)str, *end = p + len;
+	const uint32_t *delta = set->delta;
+	const size_t width = set->classes;
+	uint32_t state = 0;
+
+	for (; p < end; ++p)
+	{
+		state = delta[state * width + set->class_of[*p]];
+		uint32_t hit = set->match[state] >= 0 ? state : set->next_match[state];
+		for (; hit; hit = set->next_match[hit])
+		{
+			int32_t i = set->match[hit];
+			if (seen[i])
+				continue;
+			seen[i] = 1;
+			PyObject *pair = Py_BuildValue("(Os)", field, set->patterns[i]);
+			if (pair == NULL || PyList_Append(list, pair) < 0)
+			{
+				Py_XDECREF(pair);
+				return -1;
+			}
+			Py_DECREF(pair);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Scan each str of a Python list or the ``KEY=value`` items of a Python
+ * mapping, so that no match spans two entries
+ */
+static int scan_pattern_set_python(const struct pattern_set *set, PyObject *obj, PyObject *field,
+								   unsigned char *seen, PyObject *list)
+{
+	if (obj == NULL || obj == Py_None)
+		return 0;
+
+	if (PyUnicode_Check(obj))
+	{
+		Py_ssize_t len;
+		const char *str = PyUnicode_AsUTF8AndSize(obj, &len);
+		return str ? scan_pattern_set(set, str, len, field, seen, list) : -1;
+	}
+
+	PyObject *items = PyMapping_Check(obj) && !PySequence_Check(obj) ? PyMapping_Items(obj) : PySequence_List(obj);
+	if (items == NULL)
+		return -1;
+
+	int rc = 0;
+	for (Py_ssize_t i = 0; rc == 0 && i < PyList_GET_SIZE(items); ++i)
+	{
+		PyObject *item = PyList_GET_ITEM(items, i);
+		PyObject *str = PyTuple_Check(item) ? PyUnicode_FromFormat("%S=%S", PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1)) : (Py_INCREF(item), item);
+		rc = str ? scan_pattern_set_python(set, str, field, seen, list) : -1;
+		Py_XDECREF(str);
+	}
+	Py_DECREF(items);
+	return rc;
+}
+
+/*
+ * ``slurm.PatternSet``, returned by ``slurm.compile_patterns()``
+ */
+typedef struct
+{
+	PyObject_HEAD
+	struct pattern_set *set;
+} PatternSetObject;
+
+static PyTypeObject *PatternSetType = NULL;
+
+static void pattern_set_dealloc(PatternSetObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+/*
+ * Return ``(field, pattern)`` for every pattern found in the ``script``,
+ * ``argv`` and ``environment`` of a job descriptor, each field scanned in a
+ * single pass. The script of the submission being evaluated is read from
+ * its C buffer unless the policy has replaced it.
+ */
+static PyObject *pattern_set_scan(PatternSetObject *self, PyObject *arg)
+{
+	const struct pattern_set *set = self->set;
+	static const char *fields[] = {"script", "argv", "environment"};
+	PyObject *list = PyList_New(0);
+	unsigned char *seen = xcalloc(set->count + 1, 1);
+	int rc = 0;
+
+	for (int f = 0; rc == 0 && f < 3; ++f)
+	{
+		PyObject *field = PyUnicode_FromString(fields[f]);
+		if (field == NULL || list == NULL)
+		{
+			Py_XDECREF(field);
+			rc = -1;
+			break;
+		}
+		memset(seen, 0, set->count);
+
+		PyObject *value = NULL;
+		if (f == 0)
+		{
+			Py_ssize_t len;
+			PyObject *owner;
+			const char *script = script_of(arg, &len, &owner);
+			if (script)
+				rc = scan_pattern_set(set, script, len, field, seen, list);
+			else if (PyErr_ExceptionMatches(PyExc_KeyError))
+				PyErr_Clear(); // A missing entry has nothing to match
+			else
+				rc = -1;
+			Py_XDECREF(owner);
+		}
+		else if (PyMapping_Check(arg) && (value = PyMapping_GetItemString(arg, fields[f])) == NULL)
+		{
+			if (PyErr_ExceptionMatches(PyExc_KeyError))
+				PyErr_Clear();
+			else
+				rc = -1;
+		}
+		else
+		{
+			rc = scan_pattern_set_python(set, value, field, seen, list);
+		}
+		Py_XDECREF(value);
+		Py_DECREF(field);
+	}
+
+	xfree(seen);
+	if (rc < 0)
+	{
+		Py_XDECREF(list);
+		return NULL;
+	}
+	return list;
+}
+
+/*
+ * Return the patterns found in a str, in order of first occurrence
+ */
+static PyObject *pattern_set_search(PatternSetObject *self, PyObject *arg)
+{
+	PyObject *field = PyUnicode_FromString("");
+	PyObject *pairs = PyList_New(0);
+	unsigned char *seen = xcalloc(self->set->count + 1, 1);
+	int rc = (field && pairs) ? scan_pattern_set_python(self->set, arg, field, seen, pairs) : -1;
+	xfree(seen);
+	Py_XDECREF(field);
+
+	PyObject *list = rc == 0 ? PyList_New(PyList_GET_SIZE(pairs)) : NULL;
+	for (Py_ssize_t i = 0; list && i < PyList_GET_SIZE(pairs); ++i)
+	{
+		PyObject *pattern = PyTuple_GET_ITEM(PyList_GET_ITEM(pairs, i), 1);
+		Py_INCREF(pattern);
+		PyList_SET_ITEM(list, i, pattern);
+	}
+	Py_XDECREF(pairs);
+	return list;
+}
+
+static Py_ssize_t pattern_set_len(PatternSetObject *self)
+{
+	return self->set->count;
+}
+
+static PyMethodDef PatternSetMethods[] = {
+		{"scan", (PyCFunction)pattern_set_scan, METH_O, ""},
+		{"search", (PyCFunction)pattern_set_search, METH_O, ""},
+		{NULL, NULL, 0, NULL}};
+
+static PyType_Slot PatternSetSlots[] = {
+		{Py_tp_dealloc, pattern_set_dealloc},
+		{Py_tp_methods, PatternSetMethods},
+		{Py_sq_length, pattern_set_len},
+		{0, NULL}};
+
+static PyType_Spec PatternSetSpec = {
+		"slurm.PatternSet", sizeof(PatternSetObject), 0, Py_TPFLAGS_DEFAULT, PatternSetSlots};
+
+/*
+ * Compile an iterable of str into a ``slurm.PatternSet``. Meant to be called
+ * when the policy is loaded; compiled sets are cached across interpreter
+ * restarts, so loading the policy again does not rebuild the automaton.
+ */
+static PyObject *py_slurm_compile_patterns(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"patterns", "ignore_case", NULL};
+	PyObject *patterns;
+	int ignore_case = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", keywords, &patterns, &ignore_case))
+		return NULL;
+
+	struct pattern_set *set = lookup_pattern_set(patterns, ignore_case);
+	if (set == NULL)
+		return NULL;
+
+	PatternSetObject *obj = PyObject_New(PatternSetObject, PatternSetType);
+	if (obj == NULL)
+		return NULL;
+	obj->set = set;
+	return (PyObject *)obj;
+}
+
+/*
+ * Summary of a job array index string such as ``1-100000:2%50``
+ */
+struct array_summary
+{
+	uint64_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t step; // 0 if the ranges have different steps
+	uint32_t throttle; // 0 if not given
+};
+
+/*
+ * Summarize ``str`` in one pass without expanding its ranges. Tasks of
+ * overlapping ranges are counted once per range, so the count is an upper
+ * bound for such strings. Return false if the string is invalid.
+ */
+static bool parse_array_string(const char *str, struct array_summary *summary)
+{
+	const char *p = str;
+	bool first = true;
+
+	memset(summary, 0, sizeof(*summary));
+	for (;;)
+	{
+		uint32_t start, end, step = 1;
+		if (!parse_array_number(&p, &start))
+			return false;
+		end = start;
+		if (*p == '-')
+		{
+			++p;
+			if (!parse_array_number(&p, &end) || end < start)
+				return false;
+			if (*p == ':')
+			{
+				++p;
+				if (!parse_array_number(&p, &step) || step == 0)
+					return false;
+			}
+		}
+
+		summary->count += (end - start) / step + 1;
+		// The last index actually reached by the step
+		end = start + (end - start) / step * step;
+		if (first || start < summary->min)
+			summary->min = start;
+		if (first || end > summary->max)
+			summary->max = end;
+		if (first)
+			summary->step = step;
+		else if (summary->step != step)
+			summary->step = 0;
+		first = false;
+
+		if (*p != ',')
+			break;
+		++p;
+	}
+
+	if (*p == '%')
+	{
+		++p;
+		if (!parse_array_number(&p, &summary->throttle))
+			return false;
+	}
+
+	return *p == '\0';
+}
+
+/*
+ * Return ``{"count", "min", "max", "step", "throttle"}`` for an
+ * ``array_inx`` string, or None for None. ``step`` is None if the ranges
+ * have different steps and ``throttle`` is None if not given.
+ */
+static PyObject *py_slurm_parse_array(PyObject *self, PyObject *arg)
+{
+	if (arg == Py_None)
+		Py_RETURN_NONE;
+
+	const char *str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	struct array_summary summary;
+	if (!parse_array_string(str, &summary))
+	{
+		PyErr_Format(PyExc_ValueError, "invalid array index \"%s\"", str);
+		return NULL;
+	}
+
+	PyObject *step = summary.step ? PyLong_FromUnsignedLong(summary.step) : (Py_INCREF(Py_None), Py_None);
+	PyObject *throttle = summary.throttle ? PyLong_FromUnsignedLong(summary.throttle) : (Py_INCREF(Py_None), Py_None);
+	PyObject *dict = NULL;
+	if (step && throttle)
+		dict = Py_BuildValue("{s:K,s:I,s:I,s:O,s:O}", "count", (unsigned long long)summary.count, "min", summary.min,
+							 "max", summary.max, "step", step, "throttle", throttle);
+	Py_XDECREF(step);
+	Py_XDECREF(throttle);
+	return dict;
+}
+
+/*
+ * Dependency types, spelled as for ``sbatch --dependency``
+ */
+static const char *dependency_types[] = {
+		"after", "afterany", "afterburstbuffer", "aftercorr", "afternotok", "afterok", "expand", "singleton", NULL};
+
+#define ARRAY_TASK_ALL (NO_VAL - 1)
+
+/*
+ * Append ``{"type", "job_id", "array_task_id", "time"}`` to ``list``, adding
+ * ``exists`` if ``check_jobs`` is set. ``array_task_id`` is None for a
+ * whole job, or ``"*"`` for all tasks of an array.
+ */
+static int append_dependency(PyObject *list, const char *type, uint32_t job_id, uint32_t task_id, uint32_t time,
+							 bool check_jobs)
+{
+	PyObject *job = job_id == NO_VAL ? (Py_INCREF(Py_None), Py_None) : PyLong_FromUnsignedLong(job_id);
+	PyObject *task = task_id == NO_VAL		   ? (Py_INCREF(Py_None), Py_None)
+					 : task_id == ARRAY_TASK_ALL ? PyUnicode_FromString("*")
+												 : PyLong_FromUnsignedLong(task_id);
+	PyObject *minutes = time == NO_VAL ? (Py_INCREF(Py_None), Py_None) : PyLong_FromUnsignedLong(time);
+	PyObject *entry = NULL;
+	if (job && task && minutes)
+		entry = Py_BuildValue("{s:s,s:O,s:O,s:O}", "type", type, "job_id", job, "array_task_id", task, "time", minutes);
+	Py_XDECREF(job);
+	Py_XDECREF(task);
+	Py_XDECREF(minutes);
+	if (entry == NULL)
+		return -1;
+
+	if (check_jobs && job_id != NO_VAL)
+	{
+		// job_submit() and the shadow thread both run with at least the job read lock, all the lookups need
+		bool exists = (task_id == NO_VAL || task_id == ARRAY_TASK_ALL) ? find_job_record(job_id) != NULL
+																	   : find_job_array_rec(job_id, task_id) != NULL;
+		if (PyDict_SetItemString(entry, "exists", exists ? Py_True : Py_False) < 0)
+		{
+			Py_DECREF(entry);
+			return -1;
+		}
+	}
+
+	int rc = PyList_Append(list, entry);
+	Py_DECREF(entry);
+	return rc;
+}
+
+/*
+ * Parse a dependency string into ``list`` following the syntax of
+ * ``sbatch --dependency``. ``*any`` is set if the entries are separated by
+ * ``?``. Return -1 and set a Python error if the string is invalid.
+ */
+static int parse_dependency_string(const char *str, PyObject *list, bool *any, bool check_jobs)
+{
+	const char *p = str;
+	char separator = 0;
+
+	*any = false;
+	for (;;)
+	{
+		const char *type = "afterany";
+		size_t len = strcspn(p, ":,?");
+
+		if (!isdigit((unsigned char)*p))
+		{
+			const char **t = dependency_types;
+			for (; *t; ++t)
+			{
+				if (strlen(*t) == len && !strncasecmp(*t, p, len))
+					break;
+			}
+			if (*t == NULL)
+				goto invalid;
+			type = *t;
+			p += len;
+
+			if (!strcmp(type, "singleton"))
+			{
+				if (append_dependency(list, type, NO_VAL, NO_VAL, NO_VAL, false) < 0)
+					return -1;
+			}
+			else if (*p != ':')
+			{
+				goto invalid;
+			}
+			else
+			{
+				++p;
+			}
+		}
+
+		// The job ids of a type, each as ``id[_task|_*][+minutes]``
+		while (strcmp(type, "singleton"))
+		{
+			uint32_t job_id, task_id = NO_VAL, time = NO_VAL;
+			if (!parse_array_number(&p, &job_id))
+				goto invalid;
+			if (*p == '_')
+			{
+				++p;
+				if (*p == '*')
+				{
+					++p;
+					task_id = ARRAY_TASK_ALL;
+				}
+				else if (!parse_array_number(&p, &task_id))
+				{
+					goto invalid;
+				}
+			}
+			if (*p == '+' && (++p, !parse_array_number(&p, &time)))
+				goto invalid;
+			if (append_dependency(list, type, job_id, task_id, time, check_jobs) < 0)
+				return -1;
+			if (*p != ':')
+				break;
+			++p;
+		}
+
+		if (*p == '\0')
+			break;
+		if ((*p != ',' && *p != '?') || (separator && *p != separator))
+			goto invalid;
+		separator = *p++;
+	}
+
+	*any = separator == '?';
+	return 0;
+
+invalid:
+	PyErr_Format(PyExc_ValueError, "invalid dependency \"%s\"", str);
+	return -1;
+}
+
+/*
+ * Return ``{"any": bool, "dependencies": [...]}`` for a dependency string,
+ * or None for None. With ``check_jobs``, each entry referring to a job also
+ * tells whether the job is known to the controller.
+ */
+static PyObject *py_slurm_parse_dependency(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"dependency", "check_jobs", NULL};
+	PyObject *arg;
+	int check_jobs = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", keywords, &arg, &check_jobs))
+		return NULL;
+
+	if (arg == Py_None)
+		Py_RETURN_NONE;
+
+	const char *str = PyUnicode_AsUTF8(arg);
+	if (str == NULL)
+		return NULL;
+
+	bool any;
+	PyObject *list = PyList_New(0);
+	if (list == NULL || parse_dependency_string(str, list, &any, check_jobs) < 0)
+	{
+		Py_XDECREF(list);
+		return NULL;
+	}
+
+	PyObject *dict = Py_BuildValue("{s:O,s:O}", "any", any ? Py_True : Py_False, "dependencies", list);
+	Py_DECREF(list);
+	return dict;
+}
+
+/*
+ * Register table of Python function name to C function
+ */
+static PyMethodDef SlurmMethods[] = {
+		{"user_msg", py_slurm_user_msg, METH_O, ""},
+		{"info", py_slurm_info, METH_O, ""},
+		{"error", py_slurm_error, METH_O, ""},
+		{"stats", py_slurm_stats, METH_NOARGS, ""},
+		{"config", py_slurm_config, METH_VARARGS, ""},
+		{"hostlist_expand", py_slurm_hostlist_expand, METH_O, ""},
+		{"hostlist_count", py_slurm_hostlist_count, METH_O, ""},
+		{"hostlist_contains", py_slurm_hostlist_contains, METH_VARARGS, ""},
+		{"hostlist_intersect", py_slurm_hostlist_intersect, METH_VARARGS, ""},
+		{"parse_tres", py_slurm_parse_tres, METH_O, ""},
+		{"script_directives", py_slurm_script_directives, METH_O, ""},
+		{"submit_options", py_slurm_submit_options, METH_NOARGS, ""},
+		{"association", (PyCFunction)(void (*)(void))py_slurm_association, METH_VARARGS | METH_KEYWORDS, ""},
+		{"node_inventory", (PyCFunction)(void (*)(void))py_slurm_node_inventory, METH_VARARGS | METH_KEYWORDS, ""},
+		{"check_constraint", (PyCFunction)(void (*)(void))py_slurm_check_constraint, METH_VARARGS | METH_KEYWORDS, ""},
+		{"parse_array", py_slurm_parse_array, METH_O, ""},
+		{"parse_licenses", (PyCFunction)(void (*)(void))py_slurm_parse_licenses, METH_VARARGS | METH_KEYWORDS, ""},
+		{"parse_dependency", (PyCFunction)(void (*)(void))py_slurm_parse_dependency, METH_VARARGS | METH_KEYWORDS, ""},
+		{"script_hash", py_slurm_script_hash, METH_O, ""},
+		{"script_sha256", py_slurm_script_sha256, METH_O, ""},
+		{"compile_patterns", (PyCFunction)(void (*)(void))py_slurm_compile_patterns, METH_VARARGS | METH_KEYWORDS, ""},
+		{"to_json", (PyCFunction)(void (*)(void))py_slurm_to_json, METH_VARARGS | METH_KEYWORDS, ""},
+		{NULL, NULL, 0, NULL}};
+
+/*
+ * Define the ``slurm`` module with the registered functions
+ */
+static PyModuleDef SlurmModule = {
+		PyModuleDef_HEAD_INIT, "slurm", NULL, -1, SlurmMethods, NULL, NULL, NULL, NULL};
+
+/*
+ * Create a heap type from ``spec`` and add it to ``module``, which keeps it
+ * alive. Static types cannot be used as they would outlive the interpreter.
+ */
+static PyTypeObject *add_type(PyObject *module, PyType_Spec *spec)
+{
+	PyObject *type = PyType_FromSpec(spec);
+	if (type == NULL)
+		return NULL;
+
+	if (PyModule_AddObject(module, strrchr(spec->name, '.') + 1, type) < 0)
+	{
+		Py_DECREF(type);
+		return NULL;
+	}
+	return (PyTypeObject *)type;
+}
+
+/*
+ * Create the ``slurm`` module
+ */
+static PyObject *PyInit_slurm()
+{
+	PyObject *module = PyModule_Create(&SlurmModule);
+	if (module == NULL)
+		return NULL;
+
+	init_association_getset();
+	if (!(HostlistType = add_type(module, &HostlistSpec)) ||
+		!(HostlistIterType = add_type(module, &HostlistIterSpec)) ||
+		!(DecodedViewType = add_type(module, &DecodedViewSpec)) ||
+		!(ResourceViewType = add_type(module, &ResourceViewSpec)) ||
+		!(AssociationViewType = add_type(module, &AssociationViewSpec)) ||
+		!(PatternSetType = add_type(module, &PatternSetSpec)) ||
+		!(JobDescriptorType = add_job_descriptor_type(module)))
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
+	if (!(TresViewType = add_type(module, &TresViewSpec)))
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+#endif
+	if (PyModule_AddIntConstant(module, "STOP", POLICY_STOP) < 0)
+	{
+		Py_DECREF(module);
+		return NULL;
+	}
+
+	return module;
+}
+
+/*
+ * The plugin's entry point
+ */
+int py_init(void)
+{
+#ifdef DEBUG
+	info("[py_init] pid=%ld\n", syscall(__NR_gettid));
+#endif
+
+	// Create the slurm module and put it in the path
+	PyImport_AppendInittab("slurm", &PyInit_slurm);
+	Py_Initialize();
+
+	// Append the script directory to the Python path
+	PyObject *sysPath = PySys_GetObject((char *)"path");
+	PyObject *script_path = PyUnicode_FromString(DEFAULT_SCRIPT_DIR);
+	PyList_Append(sysPath, script_path);
+	Py_DECREF(script_path);
+#ifdef DEBUG
+	info("[py_init] RETURN");
+#endif
+
+	return SLURM_SUCCESS;
+}
+
+/*
+ * Apply a single ``key=value`` setting from the configuration file
+ */
+static void apply_config_option(const char *key, const char *value)
+{
+	if (!xstrcasecmp(key, "ShedQueueDepth"))
+	{
+		shed_queue_depth = strtoul(value, NULL, 10);
+	}
+	else if (!xstrcasecmp(key, "ShedPolicy"))
+	{
+		if (!xstrcasecmp(value, "accept"))
+			shed_policy = SHED_POLICY_ACCEPT;
+		else if (!xstrcasecmp(value, "reject"))
+			shed_policy = SHED_POLICY_REJECT;
+		else
+			error("job_submit/python: Invalid ShedPolicy \"%s\", expected accept or reject", value);
+	}
+	else if (!xstrcasecmp(key, "AuditLog"))
+	{
+		xfree(audit_file);
+		if (*value && xstrcasecmp(value, "none"))
+			audit_file = xstrdup(value);
+	}
+	else if (!xstrcasecmp(key, "AuditMaxSize"))
+	{
+		audit_max_size = strtoull(value, NULL, 10) * 1024 * 1024;
+	}
+	else if (!xstrcasecmp(key, "AuditKeep"))
+	{
+		audit_keep = strtoul(value, NULL, 10);
+	}
+	else if (!xstrcasecmp(key, "AuditSyncInterval"))
+	{
+		audit_sync_interval = strtoul(value, NULL, 10);
+	}
+	else if (!xstrcasecmp(key, "ShadowScript"))
+	{
+		xfree(shadow_script);
+		if (*value && xstrcasecmp(value, "none"))
+			shadow_script = xstrdup(value);
+	}
+	else if (!xstrcasecmp(key, "ShadowQueueDepth"))
+	{
+		shadow_queue_depth = strtoul(value, NULL, 10);
+	}
+	else if (!xstrcasecmp(key, "PartitionScript"))
+	{
+		add_policy_route(&partition_scripts, key, value);
+	}
+	else if (!xstrcasecmp(key, "AccountScript"))
+	{
+		add_policy_route(&account_scripts, key, value);
+	}
+	else if (!xstrcasecmp(key, "DefaultScript"))
+	{
+		xfree(default_script);
+		if (*value && xstrcasecmp(value, "none"))
+			default_script = xstrdup(value);
+	}
+	else
+	{
+		error("job_submit/python: Unknown option \"%s\" in %s", key, CONFIG_FILE);
+	}
+}
+
+/*
+ * Read the optional configuration file. A missing file leaves every setting
+ * at its default.
+ */
+static void read_config(void)
+{
+	FILE *fp = fopen(CONFIG_FILE, "r");
+	char line[1024];
+
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		// Strip comments and surrounding white space
+		char *end = xstrchr(line, '#');
+		if (end)
+			*end = '\0';
+		char *key = line;
+		while (isspace((unsigned char)*key))
+			key++;
+		end = key + strlen(key);
+		while (end > key && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		if (*key == '\0')
+			continue;
+
+		char *value = xstrchr(key, '=');
+		if (!value)
+		{
+			error("job_submit/python: Ignoring malformed line \"%s\" in %s", key, CONFIG_FILE);
+			continue;
+		}
+		*value++ = '\0';
+		for (end = value - 1; end > key && isspace((unsigned char)end[-1]);)
+			*--end = '\0';
+		while (isspace((unsigned char)*value))
+			value++;
+
+		apply_config_option(key, value);
+	}
+
+	fclose(fp);
+}
+
+int init(void)
+{
+#ifdef DEBUG
+	info("[init] pid=%ld\n", syscall(__NR_gettid));
+#endif
+	slurm_mutex_init(&python_lock);
+	default_script = xstrdup("job_submit");
+	read_config();
+	init_job_desc_index();
+	audit_start();
+	shadow_start();
+
+	return SLURM_SUCCESS;
+}
+
+/*
+ * The plugin's cleanup function
+ */
+int py_fini(void)
+{
+#ifdef DEBUG
+	info("[py_fini] pid=%ld\n", syscall(__NR_gettid));
+#endif
+	current_job_desc = NULL;
+	Py_CLEAR(submit_options);
+	Py_FinalizeEx();
+	pattern_cache_trim(PATTERN_CACHE_SIZE);
+	return SLURM_SUCCESS;
+}
+
+int fini(void)
+{
+#ifdef DEBUG
+	info("[fini] pid=%ld\n", syscall(__NR_gettid));
+#endif
+	// The shadow thread may be running a policy using the state freed below
+	shadow_stop();
+	audit_stop();
+	node_index_flush();
+	constraint_cache_flush();
+	tres_cache_flush();
+	pattern_cache_trim(0);
+	json_buffer_free();
+	xfree(shadow_script);
+	xfree(audit_file);
+	free_policy_routes(&partition_scripts);
+	free_policy_routes(&account_scripts);
+	xfree(default_script);
+	free_stage_stats();
+	return SLURM_SUCCESS;
+}
+
+/*
+ * If a Python error has occurred then print it and a traceback to the Slurm log
+ */
+void print_python_error()
+{
+	if (PyErr_Occurred())
+	{
+		PyObject *ptype, *pvalue, *ptraceback;
+		PyErr_Fetch(&ptype, &pvalue, &ptraceback);
+		// PyErr_NormalizeException(&ptype, &pvalue, &ptraceback);
+
+		// Import the ``traceback`` module
+		PyObject *pTracebackModuleName = PyUnicode_FromString("traceback");
+		PyObject *pTracebackModule = PyImport_Import(pTracebackModuleName);
+		Py_DECREF(pTracebackModuleName);
+
+		// Get the ``traceback.format_tb`` function
+		PyObject *pFormatTbFn = PyObject_GetAttrString(pTracebackModule, "format_tb");
+		Py_DECREF(pTracebackModule);
+
+		// Get the formatted traceback
+		PyObject *pFormattedTb = PyObject_CallFunctionObjArgs(pFormatTbFn, ptraceback, NULL);
+		Py_DECREF(pFormatTbFn);
+		Py_XDECREF(ptraceback);
+
+		PyObject *pFormattedTbStr = PyObject_Str(pFormattedTb);
+
+		error("job_submit/python: %s", PyUnicode_AsUTF8(pFormattedTbStr));
+		error("job_submit/python: %s: %s", PyUnicode_AsUTF8(ptype), PyUnicode_AsUTF8(pvalue));
+
+		Py_DECREF(pFormattedTbStr);
+		Py_XDECREF(pvalue);
+		Py_DECREF(ptype);
+
+		PyErr_Clear();
+	}
+}
+
+/*
+ * Return true if none of the ``len`` bytes at ``str`` has its high bit set,
+ * checking 64 bytes per iteration where SIMD is available
+ */
+static bool is_ascii(const char *str, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 64 <= len; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(str + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(str + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(str + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(str + i + 48));
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+			return false;
+	}
+	for (; i + 16 <= len; i += 16)
+	{
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + i))))
+			return false;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 64 <= len; i += 64)
+	{
+		uint8x16_t a = vld1q_u8((const uint8_t *)str + i);
+		uint8x16_t b = vld1q_u8((const uint8_t *)str + i + 16);
+		uint8x16_t c = vld1q_u8((const uint8_t *)str + i + 32);
+		uint8x16_t d = vld1q_u8((const uint8_t *)str + i + 48);
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d))) & 0x80)
+			return false;
+	}
+	for (; i + 16 <= len; i += 16)
+	{
+		if (vmaxvq_u8(vld1q_u8((const uint8_t *)str + i)) & 0x80)
+			return false;
+	}
+#endif
+
+	for (; i < len; ++i)
+	{
+		if ((unsigned char)str[i] & 0x80)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Turn ``len`` bytes at ``str`` into a Python string. ASCII, by far the most
+ * common case for scripts and environments, is copied straight into a compact
+ * string. Anything else is decoded as UTF-8 with ``surrogateescape`` so that
+ * invalid bytes survive the round trip instead of failing the conversion.
+ */
+PyObject *c_string_to_python(const char *str, size_t len)
+{
+	if (is_ascii(str, len))
+	{
+		PyObject *obj = PyUnicode_New(len, 127);
+		if (obj != NULL)
+			memcpy(PyUnicode_1BYTE_DATA(obj), str, len);
+		return obj;
+	}
+
+	return PyUnicode_DecodeUTF8(str, len, "surrogateescape");
+}
+
+#define char_star_to_python(str) c_string_to_python(str, strlen(str))
+
+/*
+ * Return the bytes of the Python string ``obj``, reversing the
+ * ``surrogateescape`` decoding of ``c_string_to_python()``. If ``*bytes`` is
+ * set on return it owns the result and must be released by the caller.
+ */
+const char *python_to_c_string(PyObject *obj, PyObject **bytes)
+{
+	*bytes = NULL;
+
+	if (!PyUnicode_Check(obj))
+	{
+		PyErr_Format(PyExc_TypeError, "expected a str, not %s", Py_TYPE(obj)->tp_name);
+		return NULL;
+	}
+
+	// Cached on the object, and free for ASCII strings
+	const char *s = PyUnicode_AsUTF8(obj);
+	if (s != NULL)
+		return s;
+
+	PyErr_Clear();
+	*bytes = PyUnicode_AsEncodedString(obj, "utf-8", "surrogateescape");
+	return *bytes ? PyBytes_AS_STRING(*bytes) : NULL;
+}
+
+/*
+ * Turn a ``char**`` into a list of strings
+ */
+PyObject *char_star_star_to_python(uint32_t num_strings, char **str_list)
+{
+	PyObject *list = PyList_New(num_strings);
+
+	for (int i = 0; i < num_strings; ++i)
+	{
+		PyObject *str = char_star_to_python(str_list[i]);
+		if (str == NULL)
+		{
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, str);
+	}
+
+	return list;
+}
+
+/*
+ * Turn a list of ``a=b`` strings into a dict
+ */
+PyObject *char_star_star_to_python_dict(uint32_t num_strings, char **str_list)
+{
+	PyObject *dict = PyDict_New();
+
+	for (int i = 0; i < num_strings; ++i)
+	{
+		const char *entry = str_list[i];
+		const char *eq = xstrchr(entry, '=');
+		size_t key_len = eq ? (size_t)(eq - entry) : strlen(entry);
+		PyObject *key = c_string_to_python(entry, key_len);
+		PyObject *value = eq ? char_star_to_python(eq + 1) : c_string_to_python("", 0);
+
+		if (key == NULL || value == NULL || PyDict_SetItem(dict, key, value) < 0)
+		{
+			Py_XDECREF(key);
+			Py_XDECREF(value);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(key);
+		Py_DECREF(value);
+	}
+
+	return dict;
+}
+
+/*
+ * Free the memory associated with every string in a char* array and the array
+ * itself.
+ */
+void clear_char_star_star(uint32_t *num_strings_p, char ***str_list_p)
+{
+	for (int i = 0; i < *num_strings_p; ++i)
+	{
+		xfree((*str_list_p)[i]);
+	}
+	xfree(*str_list_p);
+	*num_strings_p = 0;
+}
+
+/*
+ * Write the policy's environment dict back to the job descriptor. Entries
+ * still in the dict are kept in their order, updated if their value changed,
+ * and the dict's new keys are appended. The dict itself is left untouched.
+ */
+void python_dict_to_environment(PyObject *obj, uint32_t *num_strings_p, char ***str_list_p)
+{
+	if (obj == Py_None)
+	{
+		clear_char_star_star(num_strings_p, str_list_p);
+		return;
 	}
 
 	if (!PyDict_Check(obj))
 	{
-		const char *type = Py_TYPE(obj)->tp_name;
-		error("job_submit/python: Environment field expected a mapping, instead found a %s", type);
+		const char *type = Py_TYPE(obj)->tp_name;
+		error("job_submit/python: Environment field expected a mapping, instead found a %s", type);
+		return;
+	}
+
+	// The keys found in the descriptor are removed from this copy, leaving the new ones
+	PyObject *remaining = PyDict_Copy(obj);
+	if (remaining == NULL)
+	{
+		error("job_submit/python: Could not copy the environment");
+		print_python_error();
+		return;
+	}
+
+	// Compact the kept entries in place; ``kept`` never passes ``i``
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < *num_strings_p; ++i)
+	{
+		char *entry = (*str_list_p)[i];
+		char *eq = xstrchr(entry, '=');
+		size_t key_len = eq ? (size_t)(eq - entry) : strlen(entry);
+		const char *value = eq ? eq + 1 : "";
+		// Look the key up as an object, it may not be valid UTF-8
+		PyObject *p_key = c_string_to_python(entry, key_len);
+		PyObject *p_value = p_key ? PyDict_GetItemWithError(remaining, p_key) : NULL;
+		if (p_value != NULL)
+		{
+			// The key is still there but we must check if the value has been changed
+			PyObject *p_str = PyObject_Str(p_value);
+			PyObject *bytes = NULL;
+			const char *s = p_str ? python_to_c_string(p_str, &bytes) : NULL;
+			if (s == NULL)
+			{
+				error("job_submit/python: Could not convert environment variable %.*s", (int)key_len, entry);
+				print_python_error();
+			}
+			else if (strcmp(s, value) != 0)
+			{
+				char *updated = xstrdup_printf("%.*s=%s", (int)key_len, entry, s);
+				xfree(entry);
+				entry = updated;
+			}
+			Py_XDECREF(bytes);
+			Py_XDECREF(p_str);
+			if (PyDict_DelItem(remaining, p_key) < 0)
+				print_python_error();
+		}
+		else if (PyErr_Occurred())
+		{
+			// Keep the variable as it was rather than dropping it
+			error("job_submit/python: Could not look up environment variable %.*s", (int)key_len, entry);
+			print_python_error();
+		}
+		else
+		{
+			// Key has been removed by the user so remove it from the job descriptor
+			xfree(entry);
+			entry = NULL;
+		}
+		Py_XDECREF(p_key);
+		if (entry)
+			(*str_list_p)[kept++] = entry;
+	}
+
+	// Append the keys added by the policy, skipping those that do not convert
+	PyObject *items = PyDict_Items(remaining);
+	Py_DECREF(remaining);
+	if (items == NULL)
+		print_python_error();
+	Py_ssize_t added = items ? PyList_GET_SIZE(items) : 0;
+	xrealloc(*str_list_p, (kept + added + 1) * sizeof(char *));
+	for (Py_ssize_t i = 0; i < added; ++i)
+	{
+		PyObject *item = PyList_GET_ITEM(items, i);
+		PyObject *p_key = PyObject_Str(PyTuple_GET_ITEM(item, 0));
+		PyObject *p_str = PyObject_Str(PyTuple_GET_ITEM(item, 1));
+		PyObject *key_bytes = NULL, *bytes = NULL;
+		const char *key = p_key ? python_to_c_string(p_key, &key_bytes) : NULL;
+		const char *s = p_str ? python_to_c_string(p_str, &bytes) : NULL;
+		if (key == NULL || s == NULL)
+		{
+			error("job_submit/python: Could not convert a new environment variable");
+			print_python_error();
+		}
+		else
+		{
+			(*str_list_p)[kept++] = xstrdup_printf("%s=%s", key, s);
+		}
+		Py_XDECREF(key_bytes);
+		Py_XDECREF(bytes);
+		Py_XDECREF(p_key);
+		Py_XDECREF(p_str);
+	}
+	Py_XDECREF(items);
+	*num_strings_p = kept;
+}
+
+void python_to_char_star_star(PyObject *obj, uint32_t *num_strings_p, char ***str_list_p)
+{
+	if (obj == Py_None)
+	{
+		clear_char_star_star(num_strings_p, str_list_p);
+		return;
+	}
+
+	PyObject *list = PySequence_Fast(obj, "attribute is not a sequence");
+
+	if (list == NULL)
+	{
+		print_python_error();
+		clear_char_star_star(num_strings_p, str_list_p);
+		return;
+	}
+
+	int python_count = PySequence_Fast_GET_SIZE(list);
+
+	// If the list is empty, set the array to NULL
+	if (python_count == 0)
+	{
+		clear_char_star_star(num_strings_p, str_list_p);
+		return;
+	}
+
+	// If some entries have been removed the we should clear the memory that we will not need
+	if (python_count < (*num_strings_p))
+	{
+		for (int i = python_count; i < *num_strings_p; ++i)
+		{
+			xfree((*str_list_p)[i]);
+		}
+	}
+
+	// If there are more Pytohn strings than entries in the array then we
+	// must make the array larger to the correct amount
+	if (python_count != (*num_strings_p))
+	{
+		*num_strings_p = python_count;
+		*str_list_p = xrealloc(*str_list_p, sizeof(char *) * (*num_strings_p));
+	}
+
+	// Fill the array with the values from the list
+	for (int i = 0; i < python_count; ++i)
+	{
+		PyObject *obj = PySequence_Fast_GET_ITEM(list, i);
+		PyObject *str = PyObject_Str(obj);
+		PyObject *bytes = NULL;
+		const char *s = str ? python_to_c_string(str, &bytes) : NULL;
+
+		(*str_list_p)[i] = xstrdup(s ? s : "");
+
+		Py_XDECREF(bytes);
+		Py_XDECREF(str);
+	}
+
+	Py_DECREF(list);
+	print_python_error(); // If there was one
+}
+
+/*
+ * ``slurm.JobDescriptor``, the job descriptor handed to ``job_submit()``.
+ * Each field is an attribute generated from ``job_desc_fields``, also
+ * reachable with item syntax. A field is read from its fixed offset in the
+ * ``job_descriptor`` struct the first time it is accessed and then kept on
+ * the object, so that lists and the environment can be edited in place.
+ * Only the fields the policy assigned, and the containers it has read, are
+ * written back.
+ */
+enum job_desc_kind
+{
+	DESC_STRING,
+	DESC_STRING_LIST,
+	DESC_ENVIRONMENT,
+	DESC_UINT, // NO_VAL of the width of the field is None
+	DESC_BOOL,
+	DESC_TIME,
+	DESC_FLAGS,	 // also written back from flag names
+	DESC_MEMORY, // also written back from the ``decoded`` form
+	DESC_VIEW	 // read-only, computed natively
+};
+
+struct job_desc_field
+{
+	const char *name;
+	enum job_desc_kind kind;
+	size_t offset;
+	size_t size;
+	size_t count_offset;		   // uint32_t length of a list
+	const struct flag_name *names; // of flags
+	PyObject *(*create)(void);	   // of a view
+};
+
+#define JOB_DESC_MEMBER(name) offsetof(struct job_descriptor, name), sizeof(((struct job_descriptor *)0)->name)
+#define JOB_DESC_FIELD(name, kind) {#name, kind, JOB_DESC_MEMBER(name)}
+#define JOB_DESC_LIST(name, kind, count) {#name, kind, JOB_DESC_MEMBER(name), offsetof(struct job_descriptor, count)}
+#define JOB_DESC_FLAGS(name, names) {#name, DESC_FLAGS, JOB_DESC_MEMBER(name), 0, names}
+#define JOB_DESC_VIEW(name, create) {#name, DESC_VIEW, 0, 0, 0, NULL, create}
+
+static const struct job_desc_field job_desc_fields[] = {
+		JOB_DESC_FIELD(account, DESC_STRING),
+		JOB_DESC_FIELD(acctg_freq, DESC_STRING),
+		JOB_DESC_FIELD(admin_comment, DESC_STRING),
+		JOB_DESC_FIELD(alloc_node, DESC_STRING),
+		JOB_DESC_FIELD(alloc_resp_port, DESC_UINT),
+		JOB_DESC_FIELD(alloc_sid, DESC_UINT),
+		JOB_DESC_LIST(argv, DESC_STRING_LIST, argc),
+		JOB_DESC_FIELD(array_inx, DESC_STRING),
+		JOB_DESC_FIELD(begin_time, DESC_TIME),
+		JOB_DESC_FLAGS(bitflags, bitflags_names),
+		JOB_DESC_FIELD(burst_buffer, DESC_STRING),
+		JOB_DESC_FIELD(clusters, DESC_STRING),
+		JOB_DESC_FIELD(comment, DESC_STRING),
+		JOB_DESC_FIELD(contiguous, DESC_BOOL),
+		JOB_DESC_FIELD(core_spec, DESC_UINT),
+		JOB_DESC_FIELD(cpu_bind, DESC_STRING),
+		JOB_DESC_FLAGS(cpu_bind_type, cpu_bind_type_names),
+		JOB_DESC_FIELD(cpu_freq_min, DESC_UINT),
+		JOB_DESC_FIELD(cpu_freq_max, DESC_UINT),
+		JOB_DESC_FIELD(cpu_freq_gov, DESC_UINT),
+		JOB_DESC_FIELD(deadline, DESC_TIME),
+		JOB_DESC_FIELD(delay_boot, DESC_UINT),
+		JOB_DESC_FIELD(dependency, DESC_STRING),
+		JOB_DESC_FIELD(end_time, DESC_TIME),
+		JOB_DESC_LIST(environment, DESC_ENVIRONMENT, env_size),
+		JOB_DESC_FIELD(exc_nodes, DESC_STRING),
+		JOB_DESC_FIELD(features, DESC_STRING),
+		JOB_DESC_FIELD(group_id, DESC_UINT),
+		JOB_DESC_FIELD(immediate, DESC_BOOL),
+		JOB_DESC_FIELD(job_id, DESC_UINT),
+		JOB_DESC_FIELD(job_id_str, DESC_STRING),
+		JOB_DESC_FIELD(kill_on_node_fail, DESC_BOOL),
+		JOB_DESC_FIELD(licenses, DESC_STRING),
+		JOB_DESC_FLAGS(mail_type, mail_type_names),
+		JOB_DESC_FIELD(mail_user, DESC_STRING),
+		JOB_DESC_FIELD(mcs_label, DESC_STRING),
+		JOB_DESC_FIELD(mem_bind, DESC_STRING),
+		JOB_DESC_FLAGS(mem_bind_type, mem_bind_type_names),
+		JOB_DESC_FIELD(name, DESC_STRING),
+		JOB_DESC_FIELD(network, DESC_STRING),
+		JOB_DESC_FIELD(nice, DESC_UINT),
+		JOB_DESC_FIELD(num_tasks, DESC_UINT),
+		JOB_DESC_FIELD(open_mode, DESC_UINT),
+		JOB_DESC_FIELD(other_port, DESC_UINT),
+		JOB_DESC_FIELD(overcommit, DESC_BOOL),
+		JOB_DESC_FIELD(partition, DESC_STRING),
+		JOB_DESC_FIELD(plane_size, DESC_UINT),
+		JOB_DESC_FIELD(power_flags, DESC_UINT),
+		JOB_DESC_FIELD(priority, DESC_UINT),
+		JOB_DESC_FIELD(profile, DESC_UINT),
+		JOB_DESC_FIELD(qos, DESC_STRING),
+		JOB_DESC_FIELD(reboot, DESC_BOOL),
+		JOB_DESC_FIELD(resp_host, DESC_STRING),
+		JOB_DESC_FIELD(restart_cnt, DESC_UINT),
+		JOB_DESC_FIELD(req_nodes, DESC_STRING),
+		JOB_DESC_FIELD(requeue, DESC_BOOL),
+		JOB_DESC_FIELD(reservation, DESC_STRING),
+		JOB_DESC_FIELD(script, DESC_STRING),
+		JOB_DESC_FIELD(shared, DESC_UINT),
+		JOB_DESC_LIST(spank_job_env, DESC_STRING_LIST, spank_job_env_size),
+		JOB_DESC_FIELD(task_dist, DESC_UINT),
+		JOB_DESC_FIELD(time_limit, DESC_UINT),
+		JOB_DESC_FIELD(time_min, DESC_UINT),
+		JOB_DESC_FIELD(user_id, DESC_UINT),
+		JOB_DESC_FIELD(wait_all_nodes, DESC_BOOL),
+		JOB_DESC_FIELD(warn_flags, DESC_UINT),
+		JOB_DESC_FIELD(warn_signal, DESC_UINT),
+		JOB_DESC_FIELD(warn_time, DESC_UINT),
+		JOB_DESC_FIELD(work_dir, DESC_STRING),
+		JOB_DESC_FIELD(cpus_per_task, DESC_UINT),
+		JOB_DESC_FIELD(min_cpus, DESC_UINT),
+		JOB_DESC_FIELD(max_cpus, DESC_UINT),
+		JOB_DESC_FIELD(min_nodes, DESC_UINT),
+		JOB_DESC_FIELD(max_nodes, DESC_UINT),
+		JOB_DESC_FIELD(boards_per_node, DESC_UINT),
+		JOB_DESC_FIELD(sockets_per_board, DESC_UINT),
+		JOB_DESC_FIELD(sockets_per_node, DESC_UINT),
+		JOB_DESC_FIELD(cores_per_socket, DESC_UINT),
+		JOB_DESC_FIELD(threads_per_core, DESC_UINT),
+		JOB_DESC_FIELD(ntasks_per_node, DESC_UINT),
+		JOB_DESC_FIELD(ntasks_per_socket, DESC_UINT),
+		JOB_DESC_FIELD(ntasks_per_core, DESC_UINT),
+		JOB_DESC_FIELD(ntasks_per_board, DESC_UINT),
+		JOB_DESC_FIELD(pn_min_cpus, DESC_UINT),
+		JOB_DESC_FIELD(pn_min_memory, DESC_MEMORY),
+		JOB_DESC_FIELD(pn_min_tmp_disk, DESC_UINT),
+		JOB_DESC_FIELD(req_switch, DESC_UINT),
+		JOB_DESC_FIELD(std_err, DESC_STRING),
+		JOB_DESC_FIELD(std_in, DESC_STRING),
+		JOB_DESC_FIELD(std_out, DESC_STRING),
+		JOB_DESC_FIELD(wait4switch, DESC_UINT),
+		JOB_DESC_FIELD(wckey, DESC_STRING),
+		JOB_DESC_VIEW(decoded, create_decoded_view),
+		JOB_DESC_VIEW(resources, create_resource_view),
+
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 2, 0) && SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17, 11, 0)
+		JOB_DESC_FIELD(fed_siblings, DESC_UINT),
+		JOB_DESC_FIELD(group_number, DESC_UINT),
+		JOB_DESC_FIELD(numpack, DESC_UINT),
+		JOB_DESC_FIELD(pack_leader, DESC_UINT),
+		JOB_DESC_LIST(pelog_env, DESC_ENVIRONMENT, pelog_env_size),
+		JOB_DESC_FIELD(resv_port, DESC_UINT),
+#endif
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 11, 0)
+		JOB_DESC_FIELD(cluster_features, DESC_STRING),
+		JOB_DESC_FIELD(extra, DESC_STRING),
+		JOB_DESC_FIELD(fed_siblings_active, DESC_UINT),
+		JOB_DESC_FIELD(fed_siblings_viable, DESC_UINT),
+		JOB_DESC_FIELD(origin_cluster, DESC_STRING),
+		JOB_DESC_FIELD(x11, DESC_UINT),
+		JOB_DESC_FIELD(x11_magic_cookie, DESC_STRING),
+		JOB_DESC_FIELD(x11_target_port, DESC_UINT),
+#endif
+
+#if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(18, 8, 0)
+		JOB_DESC_FIELD(gres, DESC_STRING),
+#endif
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
+		JOB_DESC_FIELD(batch_features, DESC_STRING),
+		JOB_DESC_FIELD(cpus_per_tres, DESC_STRING),
+		JOB_DESC_FIELD(mem_per_tres, DESC_STRING),
+		JOB_DESC_FIELD(tres_bind, DESC_STRING),
+		JOB_DESC_FIELD(tres_freq, DESC_STRING),
+		JOB_DESC_FIELD(tres_per_job, DESC_STRING),
+		JOB_DESC_FIELD(tres_per_node, DESC_STRING),
+		JOB_DESC_FIELD(tres_per_socket, DESC_STRING),
+		JOB_DESC_FIELD(tres_per_task, DESC_STRING),
+		JOB_DESC_VIEW(tres, create_tres_view),
+#endif
+
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(19, 5, 0)
+		JOB_DESC_FIELD(site_factor, DESC_UINT),
+		JOB_DESC_FIELD(x11_target, DESC_STRING),
+#endif
+
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(21, 0, 0)
+		JOB_DESC_FIELD(submit_line, DESC_STRING),
+#endif
+};
+
+#define JOB_DESC_FIELD_COUNT (sizeof(job_desc_fields) / sizeof(job_desc_fields[0]))
+
+typedef struct
+{
+	PyObject_HEAD
+	uint64_t generation;
+	struct job_descriptor *job_desc;
+	uint64_t assigned[(JOB_DESC_FIELD_COUNT + 63) / 64];
+	PyObject *values[JOB_DESC_FIELD_COUNT];
+} JobDescriptorObject;
+
+// Indices of ``job_desc_fields`` sorted by name, for item lookups
+static int job_desc_sorted[JOB_DESC_FIELD_COUNT];
+static Py_ssize_t job_desc_key_count = 0;
+
+#define job_desc_member(job_desc, field, type) ((type *)((char *)(job_desc) + (field)->offset))
+#define job_desc_assigned(self, i) (((self)->assigned[(i) / 64] >> ((i) % 64)) & 1)
+
+static uint64_t no_val_of_size(size_t size)
+{
+	switch (size)
+	{
+	case 1:
+		return NO_VAL8;
+	case 2:
+		return NO_VAL16;
+	case 4:
+		return NO_VAL;
+	default:
+		return NO_VAL64;
+	}
+}
+
+static uint64_t job_desc_get_uint(const struct job_descriptor *job_desc, const struct job_desc_field *field)
+{
+	switch (field->size)
+	{
+	case 1:
+		return *job_desc_member(job_desc, field, const uint8_t);
+	case 2:
+		return *job_desc_member(job_desc, field, const uint16_t);
+	case 4:
+		return *job_desc_member(job_desc, field, const uint32_t);
+	default:
+		return *job_desc_member(job_desc, field, const uint64_t);
+	}
+}
+
+static void job_desc_set_uint(struct job_descriptor *job_desc, const struct job_desc_field *field, uint64_t value)
+{
+	switch (field->size)
+	{
+	case 1:
+		*job_desc_member(job_desc, field, uint8_t) = value;
+		break;
+	case 2:
+		*job_desc_member(job_desc, field, uint16_t) = value;
+		break;
+	case 4:
+		*job_desc_member(job_desc, field, uint32_t) = value;
+		break;
+	default:
+		*job_desc_member(job_desc, field, uint64_t) = value;
+		break;
+	}
+}
+
+/*
+ * Turn a field of the ``job_descriptor`` struct into a Python object
+ */
+static PyObject *job_desc_field_to_python(const struct job_descriptor *job_desc, const struct job_desc_field *field)
+{
+	if (field->kind == DESC_VIEW)
+		return field->create();
+	if (field->kind == DESC_TIME)
+		return PyLong_FromLongLong(*job_desc_member(job_desc, field, const time_t));
+
+	if (field->kind == DESC_UINT || field->kind == DESC_BOOL || field->kind == DESC_FLAGS || field->kind == DESC_MEMORY)
+	{
+		uint64_t value = job_desc_get_uint(job_desc, field);
+		if (value == no_val_of_size(field->size))
+			Py_RETURN_NONE;
+		if (field->kind == DESC_BOOL)
+			return PyBool_FromLong(value);
+		return PyLong_FromUnsignedLongLong(value);
+	}
+
+	if (field->kind == DESC_STRING)
+	{
+		const char *str = *job_desc_member(job_desc, field, char *const);
+		if (str == NULL)
+			Py_RETURN_NONE;
+		return char_star_to_python(str);
+	}
+
+	char **list = *job_desc_member(job_desc, field, char **const);
+	uint32_t count = *(const uint32_t *)((const char *)job_desc + field->count_offset);
+	if (list == NULL)
+		Py_RETURN_NONE;
+	if (field->kind == DESC_ENVIRONMENT)
+		return char_star_star_to_python_dict(count, list);
+	return char_star_star_to_python(count, list);
+}
+
+/*
+ * Write ``obj`` back into a field of the ``job_descriptor`` struct, logging
+ * values that cannot be converted and leaving the field as it was
+ */
+static void job_desc_field_from_python(struct job_descriptor *job_desc, const struct job_desc_field *field, PyObject *obj)
+{
+	uint64_t value;
+	bool converted = true;
+
+	switch (field->kind)
+	{
+	case DESC_STRING:
+	{
+		char **str = job_desc_member(job_desc, field, char *);
+		if (obj == Py_None)
+		{
+			xfree(*str);
+			break;
+		}
+		PyObject *bytes;
+		const char *s = python_to_c_string(obj, &bytes);
+		if (s == NULL)
+			converted = false;
+		else if (*str == NULL || strcmp(s, *str) != 0)
+		{
+			xfree(*str);
+			*str = xstrdup(s);
+		}
+		Py_XDECREF(bytes);
+		break;
+	}
+	case DESC_STRING_LIST:
+		python_to_char_star_star(obj, (uint32_t *)((char *)job_desc + field->count_offset),
+								 job_desc_member(job_desc, field, char **));
+		break;
+	case DESC_ENVIRONMENT:
+		python_dict_to_environment(obj, (uint32_t *)((char *)job_desc + field->count_offset),
+								   job_desc_member(job_desc, field, char **));
+		break;
+	case DESC_TIME:
+		if (obj == Py_None)
+			*job_desc_member(job_desc, field, time_t) = 0;
+		else if ((value = PyLong_AsLongLong(obj)) != (uint64_t)-1 || !PyErr_Occurred())
+			*job_desc_member(job_desc, field, time_t) = value;
+		else
+			converted = false;
+		break;
+	case DESC_UINT:
+	case DESC_BOOL:
+	case DESC_FLAGS:
+	case DESC_MEMORY:
+		if (obj == Py_None)
+			value = no_val_of_size(field->size);
+		else if (PyLong_Check(obj))
+			converted = (value = PyLong_AsUnsignedLongLong(obj)) != (uint64_t)-1 || !PyErr_Occurred();
+		else if (field->kind == DESC_FLAGS)
+			converted = python_to_flags(obj, field->names, &value);
+		else if (field->kind == DESC_MEMORY)
+			converted = python_to_memory(obj, &value);
+		else
+			converted = (PyErr_Format(PyExc_TypeError, "expected an int, not %s", Py_TYPE(obj)->tp_name), false);
+		if (converted)
+			job_desc_set_uint(job_desc, field, value);
+		break;
+	case DESC_VIEW:
+		break;
+	}
+
+	if (!converted)
+	{
+		error("job_submit/python: Could not convert job description entry %s", field->name);
+		print_python_error();
+	}
+}
+
+/*
+ * Return a copy of the fields of ``job_desc`` listed in ``job_desc_fields``,
+ * the other members are left zero. Release it with ``free_job_desc_copy()``.
+ */
+static struct job_descriptor *copy_job_desc(const struct job_descriptor *job_desc)
+{
+	struct job_descriptor *copy = xmalloc(sizeof(*copy));
+
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		const struct job_desc_field *field = &job_desc_fields[i];
+		if (field->kind == DESC_VIEW)
+			continue;
+		if (field->kind == DESC_STRING)
+		{
+			*job_desc_member(copy, field, char *) = xstrdup(*job_desc_member(job_desc, field, char *const));
+			continue;
+		}
+		if (field->kind == DESC_STRING_LIST || field->kind == DESC_ENVIRONMENT)
+		{
+			char **list = *job_desc_member(job_desc, field, char **const);
+			uint32_t count = *(const uint32_t *)((const char *)job_desc + field->count_offset);
+			if (list == NULL)
+				continue;
+			char **dup = xmalloc(sizeof(char *) * (count ? count : 1));
+			for (uint32_t j = 0; j < count; ++j)
+				dup[j] = xstrdup(list[j]);
+			*job_desc_member(copy, field, char **) = dup;
+			*(uint32_t *)((char *)copy + field->count_offset) = count;
+			continue;
+		}
+		memcpy((char *)copy + field->offset, (const char *)job_desc + field->offset, field->size);
+	}
+
+	return copy;
+}
+
+static void free_job_desc_copy(struct job_descriptor *copy)
+{
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		const struct job_desc_field *field = &job_desc_fields[i];
+		if (field->kind == DESC_STRING)
+			xfree(*job_desc_member(copy, field, char *));
+		else if (field->kind == DESC_STRING_LIST || field->kind == DESC_ENVIRONMENT)
+			clear_char_star_star((uint32_t *)((char *)copy + field->count_offset), job_desc_member(copy, field, char **));
+	}
+	xfree(copy);
+}
+
+/*
+ * Return the index in ``job_desc_fields`` of the field called ``name``, or
+ * -1 if there is none
+ */
+static int job_desc_field_index(const char *name)
+{
+	int lo = 0, hi = JOB_DESC_FIELD_COUNT - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int cmp = strcmp(name, job_desc_fields[job_desc_sorted[mid]].name);
+		if (cmp == 0)
+			return job_desc_sorted[mid];
+		if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/*
+ * Return the index of the field named by the item key ``key``, raising
+ * KeyError if there is none
+ */
+static int job_descriptor_key(PyObject *key)
+{
+	const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+	int i = name ? job_desc_field_index(name) : -1;
+	if (i < 0)
+	{
+		PyErr_Clear();
+		PyErr_SetObject(PyExc_KeyError, key);
+	}
+	return i;
+}
+
+static void job_descriptor_dealloc(JobDescriptorObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+		Py_XDECREF(self->values[i]);
+	type->tp_free(self);
+	Py_DECREF(type);
+}
+
+/*
+ * Return the value of field ``i``, reading it from the struct on first use
+ */
+static PyObject *job_descriptor_value(JobDescriptorObject *self, int i)
+{
+	if (self->values[i] == NULL)
+	{
+		if (!check_generation(self->generation))
+			return NULL;
+		self->values[i] = job_desc_field_to_python(self->job_desc, &job_desc_fields[i]);
+		if (self->values[i] == NULL)
+			return NULL;
+	}
+
+	Py_INCREF(self->values[i]);
+	return self->values[i];
+}
+
+static int job_descriptor_assign(JobDescriptorObject *self, int i, PyObject *value)
+{
+	if (value == NULL || job_desc_fields[i].kind == DESC_VIEW)
+	{
+		PyErr_Format(PyExc_TypeError, "job descriptor field %s cannot be %s", job_desc_fields[i].name,
+					 value ? "assigned" : "deleted");
+		return -1;
+	}
+	if (!check_generation(self->generation))
+		return -1;
+
+	Py_INCREF(value);
+	Py_XSETREF(self->values[i], value);
+	self->assigned[i / 64] |= 1ull << (i % 64);
+	return 0;
+}
+
+static PyObject *job_descriptor_get(JobDescriptorObject *self, void *closure)
+{
+	return job_descriptor_value(self, (const struct job_desc_field *)closure - job_desc_fields);
+}
+
+static int job_descriptor_set(JobDescriptorObject *self, PyObject *value, void *closure)
+{
+	return job_descriptor_assign(self, (const struct job_desc_field *)closure - job_desc_fields, value);
+}
+
+static PyObject *job_descriptor_subscript(JobDescriptorObject *self, PyObject *key)
+{
+	int i = job_descriptor_key(key);
+	return i < 0 ? NULL : job_descriptor_value(self, i);
+}
+
+static int job_descriptor_ass_subscript(JobDescriptorObject *self, PyObject *key, PyObject *value)
+{
+	int i = job_descriptor_key(key);
+	return i < 0 ? -1 : job_descriptor_assign(self, i, value);
+}
+
+static Py_ssize_t job_descriptor_length(JobDescriptorObject *self)
+{
+	return job_desc_key_count;
+}
+
+static int job_descriptor_contains(JobDescriptorObject *self, PyObject *key)
+{
+	const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+	int i = name ? job_desc_field_index(name) : -1;
+	PyErr_Clear();
+	return i >= 0 && job_desc_fields[i].kind != DESC_VIEW;
+}
+
+/*
+ * Return a list of the keys, values or ``(key, value)`` items of the struct
+ * fields, in declaration order. The views are left out so that
+ * ``dict(job_desc)`` holds plain data.
+ */
+enum
+{
+	JOB_DESC_KEYS,
+	JOB_DESC_VALUES,
+	JOB_DESC_ITEMS
+};
+
+static PyObject *job_descriptor_list(JobDescriptorObject *self, int what)
+{
+	PyObject *list = PyList_New(0);
+
+	for (size_t i = 0; list && i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		if (job_desc_fields[i].kind == DESC_VIEW)
+			continue;
+
+		PyObject *key = what != JOB_DESC_VALUES ? PyUnicode_FromString(job_desc_fields[i].name) : NULL;
+		PyObject *value = what != JOB_DESC_KEYS ? job_descriptor_value(self, i) : NULL;
+		PyObject *entry;
+		if (what == JOB_DESC_KEYS)
+			entry = key;
+		else if (what == JOB_DESC_VALUES)
+			entry = value;
+		else
+			entry = key && value ? PyTuple_Pack(2, key, value) : NULL;
+
+		if (entry == NULL || PyList_Append(list, entry) < 0)
+			Py_CLEAR(list);
+		if (what == JOB_DESC_ITEMS)
+			Py_XDECREF(entry);
+		Py_XDECREF(key);
+		Py_XDECREF(value);
+	}
+
+	return list;
+}
+
+static PyObject *job_descriptor_keys(JobDescriptorObject *self, PyObject *unused)
+{
+	return job_descriptor_list(self, JOB_DESC_KEYS);
+}
+
+static PyObject *job_descriptor_values(JobDescriptorObject *self, PyObject *unused)
+{
+	return job_descriptor_list(self, JOB_DESC_VALUES);
+}
+
+static PyObject *job_descriptor_items(JobDescriptorObject *self, PyObject *unused)
+{
+	return job_descriptor_list(self, JOB_DESC_ITEMS);
+}
+
+static PyObject *job_descriptor_iter(JobDescriptorObject *self)
+{
+	PyObject *keys = job_descriptor_list(self, JOB_DESC_KEYS);
+	if (keys == NULL)
+		return NULL;
+	PyObject *iter = PyObject_GetIter(keys);
+	Py_DECREF(keys);
+	return iter;
+}
+
+static PyObject *job_descriptor_get_item(JobDescriptorObject *self, PyObject *args)
+{
+	PyObject *key, *fallback = Py_None;
+	if (!PyArg_ParseTuple(args, "O|O", &key, &fallback))
+		return NULL;
+
+	const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+	int i = name ? job_desc_field_index(name) : -1;
+	if (i >= 0)
+		return job_descriptor_value(self, i);
+
+	PyErr_Clear();
+	Py_INCREF(fallback);
+	return fallback;
+}
+
+static PyObject *job_descriptor_repr(JobDescriptorObject *self)
+{
+	PyObject *items = job_descriptor_list(self, JOB_DESC_ITEMS);
+	PyObject *dict = items ? PyDict_New() : NULL;
+	for (Py_ssize_t i = 0; dict && i < PyList_GET_SIZE(items); ++i)
+	{
+		PyObject *item = PyList_GET_ITEM(items, i);
+		if (PyDict_SetItem(dict, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1)) < 0)
+			Py_CLEAR(dict);
+	}
+	Py_XDECREF(items);
+	if (dict == NULL)
+		return NULL;
+
+	PyObject *repr = PyUnicode_FromFormat("slurm.JobDescriptor(%R)", dict);
+	Py_DECREF(dict);
+	return repr;
+}
+
+static PyMethodDef JobDescriptorMethods[] = {
+		{"keys", (PyCFunction)job_descriptor_keys, METH_NOARGS, NULL},
+		{"values", (PyCFunction)job_descriptor_values, METH_NOARGS, NULL},
+		{"items", (PyCFunction)job_descriptor_items, METH_NOARGS, NULL},
+		{"get", (PyCFunction)job_descriptor_get_item, METH_VARARGS, NULL},
+		{NULL, NULL, 0, NULL}};
+
+static PyGetSetDef JobDescriptorGetSet[JOB_DESC_FIELD_COUNT + 1];
+
+static PyType_Slot JobDescriptorSlots[] = {
+		{Py_tp_dealloc, job_descriptor_dealloc},
+		{Py_tp_getset, JobDescriptorGetSet},
+		{Py_tp_methods, JobDescriptorMethods},
+		{Py_tp_iter, job_descriptor_iter},
+		{Py_tp_repr, job_descriptor_repr},
+		{Py_mp_subscript, job_descriptor_subscript},
+		{Py_mp_ass_subscript, job_descriptor_ass_subscript},
+		{Py_mp_length, job_descriptor_length},
+		{Py_sq_contains, job_descriptor_contains},
+		{0, NULL}};
+
+static PyType_Spec JobDescriptorSpec = {
+		"slurm.JobDescriptor", sizeof(JobDescriptorObject), 0, Py_TPFLAGS_DEFAULT, JobDescriptorSlots};
+
+static int compare_job_desc_fields(const void *a, const void *b)
+{
+	return strcmp(job_desc_fields[*(const int *)a].name, job_desc_fields[*(const int *)b].name);
+}
+
+/*
+ * Sort the names of ``job_desc_fields`` for ``job_desc_field_index()``
+ */
+static void init_job_desc_index(void)
+{
+	job_desc_key_count = 0;
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		if (job_desc_fields[i].kind != DESC_VIEW)
+			job_desc_key_count++;
+		job_desc_sorted[i] = i;
+	}
+	qsort(job_desc_sorted, JOB_DESC_FIELD_COUNT, sizeof(job_desc_sorted[0]), compare_job_desc_fields);
+}
+
+/*
+ * Fill the attribute table of ``slurm.JobDescriptor`` from
+ * ``job_desc_fields`` and create the type
+ */
+static PyTypeObject *add_job_descriptor_type(PyObject *module)
+{
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		JobDescriptorGetSet[i].name = job_desc_fields[i].name;
+		JobDescriptorGetSet[i].get = (getter)job_descriptor_get;
+		if (job_desc_fields[i].kind != DESC_VIEW)
+			JobDescriptorGetSet[i].set = (setter)job_descriptor_set;
+		JobDescriptorGetSet[i].closure = (void *)&job_desc_fields[i];
+	}
+
+	return add_type(module, &JobDescriptorSpec);
+}
+
+/*
+ * Return a new ``slurm.JobDescriptor`` of the submission being evaluated
+ */
+static PyObject *create_job_descriptor(struct job_descriptor *job_desc)
+{
+	// The type is created with the module, which the policy may not import
+	PyObject *module = PyImport_ImportModule("slurm");
+	if (module == NULL)
+		return NULL;
+	Py_DECREF(module);
+
+	JobDescriptorObject *self = PyObject_New(JobDescriptorObject, JobDescriptorType);
+	if (self == NULL)
+		return NULL;
+	self->generation = current_generation;
+	self->job_desc = job_desc;
+	memset(self->assigned, 0, sizeof(self->assigned));
+	memset(self->values, 0, sizeof(self->values));
+	return (PyObject *)self;
+}
+
+/*
+ * Set ``*str`` to the C buffer of the job script if ``obj`` is a
+ * ``slurm.JobDescriptor`` being evaluated whose script was not assigned
+ */
+static bool job_descriptor_script(PyObject *obj, const char **str, Py_ssize_t *len)
+{
+	if (JobDescriptorType == NULL || !PyObject_TypeCheck(obj, JobDescriptorType))
+		return false;
+
+	JobDescriptorObject *self = (JobDescriptorObject *)obj;
+	int i = job_desc_field_index("script");
+	if (self->generation != current_generation || current_job_desc == NULL || job_desc_assigned(self, i))
+		return false;
+
+	*str = self->job_desc->script ? self->job_desc->script : "";
+	*len = strlen(*str);
+	return true;
+}
+
+/*
+ * A growable byte buffer
+ */
+struct byte_buffer
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * Output buffer of ``slurm.to_json()``, kept between calls so that it is
+ * only grown while the descriptors get larger. Released by ``fini()``.
+ */
+static struct byte_buffer json_buffer;
+
+#define JSON_MAX_DEPTH 32
+
+static void buffer_reserve(struct byte_buffer *buf, size_t len)
+{
+	if (buf->len + len <= buf->size)
 		return;
+	size_t size = buf->size ? buf->size : 4096;
+	while (size < buf->len + len)
+		size *= 2;
+	buf->data = xrealloc(buf->data, size);
+	buf->size = size;
+}
+
+static void buffer_append(struct byte_buffer *buf, const char *str, size_t len)
+{
+	buffer_reserve(buf, len);
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+#define buffer_append_literal(buf, str) buffer_append(buf, str, sizeof(str) - 1)
+
+static void json_append_uint(struct byte_buffer *buf, uint64_t value)
+{
+	char number[24];
+	buffer_append(buf, number, snprintf(number, sizeof(number), "%" PRIu64, value));
+}
+
+/*
+ * Return the length of the valid UTF-8 sequence at ``str``, or 0 if it is
+ * not one
+ */
+static size_t utf8_sequence_length(const unsigned char *str, size_t len)
+{
+	size_t need;
+	uint32_t min;
+	if (str[0] >= 0xc2 && str[0] <= 0xdf)
+		need = 2, min = 0x80;
+	else if ((str[0] & 0xf0) == 0xe0)
+		need = 3, min = 0x800;
+	else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+		need = 4, min = 0x10000;
+	else
+		return 0;
+	if (need > len)
+		return 0;
+
+	uint32_t code = str[0] & (0x7f >> need);
+	for (size_t i = 1; i < need; ++i)
+	{
+		if ((str[i] & 0xc0) != 0x80)
+			return 0;
+		code = (code << 6) | (str[i] & 0x3f);
 	}
+	if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+		return 0;
+	return need;
+}
 
-	uint32_t p_length = PyMapping_Length(obj);
+/*
+ * Append ``len`` bytes at ``str`` as a JSON string. Bytes that are not valid
+ * UTF-8 become the lone surrogates ``surrogateescape`` would decode them to,
+ * as ``json.dumps()`` shows the strings of the descriptor.
+ */
+static void json_append_string(struct byte_buffer *buf, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *s = (const unsigned char *)str;
+	size_t start = 0;
 
-	for (int i = 0; i < (*num_strings_p); ++i)
+	buffer_reserve(buf, len + 2);
+	buf->data[buf->len++] = '"';
+	for (size_t i = 0; i < len;)
 	{
-		char *eq = xstrchr((*str_list_p)[i], '=');
-		size_t eq_position = (size_t)(eq - (*str_list_p)[i]);
-		char *key = xstrndup((*str_list_p)[i], eq_position);
-		char *value = (*str_list_p)[i] + eq_position + 1;
-		if (PyMapping_HasKeyString(obj, key))
+		unsigned char c = s[i];
+		size_t n = 1;
+		if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80)
 		{
-			// The key is still there but we must check if the value has been changed
-			PyObject *p_value = PyMapping_GetItemString(obj, key);
-			PyMapping_DelItemString(obj, key);
-			PyObject *p_str = PyObject_Str(p_value);
-			Py_DECREF(p_value);
-			bool value_changed = PyUnicode_CompareWithASCIIString(p_str, value) != 0;
-			if (value_changed)
+			i++;
+			continue;
+		}
+		if (c >= 0x80 && (n = utf8_sequence_length(s + i, len - i)))
+		{
+			i += n;
+			continue;
+		}
+
+		buffer_append(buf, str + start, i - start);
+		char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+		if (c == '"' || c == '\\')
+			escape[1] = c, n = 2;
+		else if (c == '\n')
+			escape[1] = 'n', n = 2;
+		else if (c == '\t')
+			escape[1] = 't', n = 2;
+		else if (c == '\r')
+			escape[1] = 'r', n = 2;
+		else
+		{
+			// A byte of invalid UTF-8 turns into U+DC80..U+DCFF
+			if (c >= 0x80)
+				escape[2] = 'd', escape[3] = 'c';
+			n = 6;
+		}
+		buffer_append(buf, escape, n);
+		start = ++i;
+	}
+	buffer_append(buf, str + start, len - start);
+	buffer_append_literal(buf, "\"");
+}
+
+/*
+ * Append a Python object assigned by the policy. Containers and scalars map
+ * to their JSON counterparts, sets become arrays and anything else its str.
+ */
+static bool json_append_python(struct byte_buffer *buf, PyObject *obj, int depth)
+{
+	if (depth > JSON_MAX_DEPTH)
+	{
+		PyErr_SetString(PyExc_ValueError, "value nested too deeply");
+		return false;
+	}
+
+	if (obj == Py_None)
+		buffer_append_literal(buf, "null");
+	else if (obj == Py_True)
+		buffer_append_literal(buf, "true");
+	else if (obj == Py_False)
+		buffer_append_literal(buf, "false");
+	else if (PyLong_Check(obj))
+	{
+		// Format the value rather than the repr, which subclasses such as IntEnum override
+		int overflow;
+		long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+		if (value == -1 && PyErr_Occurred())
+			return false;
+		if (overflow == 0)
+		{
+			char num[24];
+			buffer_append(buf, num, snprintf(num, sizeof(num), "%lld", value));
+		}
+		else
+		{
+			PyObject *index = PyNumber_Index(obj); // an exact int
+			PyObject *str = index ? PyObject_Str(index) : NULL;
+			Py_ssize_t len;
+			const char *s = str ? PyUnicode_AsUTF8AndSize(str, &len) : NULL;
+			if (s != NULL)
+				buffer_append(buf, s, len);
+			Py_XDECREF(str);
+			Py_XDECREF(index);
+			if (s == NULL)
+				return false;
+		}
+	}
+	else if (PyFloat_Check(obj))
+	{
+		// NaN and infinities are not JSON
+		double value = PyFloat_AS_DOUBLE(obj);
+		char *s = isfinite(value) ? PyOS_double_to_string(value, 'r', 0, Py_DTSF_ADD_DOT_0, NULL) : NULL;
+		if (isfinite(value) && s == NULL)
+			return false;
+		if (s != NULL)
+			buffer_append(buf, s, strlen(s));
+		else
+			buffer_append_literal(buf, "null");
+		PyMem_Free(s);
+	}
+	else if (PyDict_Check(obj))
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+		bool first = true;
+		buffer_append_literal(buf, "{");
+		while (PyDict_Next(obj, &pos, &key, &value))
+		{
+			// ``pos`` is a slot index, deleted keys leave gaps before the first entry
+			if (!first)
+				buffer_append_literal(buf, ",");
+			first = false;
+			PyObject *str = PyObject_Str(key), *bytes = NULL;
+			const char *s = str ? python_to_c_string(str, &bytes) : NULL;
+			if (s != NULL)
+				json_append_string(buf, s, bytes ? (size_t)PyBytes_GET_SIZE(bytes) : strlen(s));
+			Py_XDECREF(bytes);
+			Py_XDECREF(str);
+			if (s == NULL)
+				return false;
+			buffer_append_literal(buf, ":");
+			if (!json_append_python(buf, value, depth + 1))
+				return false;
+		}
+		buffer_append_literal(buf, "}");
+	}
+	else if (PyList_Check(obj) || PyTuple_Check(obj) || PyAnySet_Check(obj))
+	{
+		PyObject *list = PySequence_Fast(obj, "expected a sequence");
+		if (list == NULL)
+			return false;
+		buffer_append_literal(buf, "[");
+		for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(list); ++i)
+		{
+			if (i)
+				buffer_append_literal(buf, ",");
+			if (!json_append_python(buf, PySequence_Fast_GET_ITEM(list, i), depth + 1))
 			{
-				xfree((*str_list_p)[i]);
-				(*str_list_p)[i] = xstrdup_printf("%s=%s", key, PyUnicode_AsUTF8(p_str));
+				Py_DECREF(list);
+				return false;
 			}
-			Py_DECREF(p_str);
 		}
+		buffer_append_literal(buf, "]");
+		Py_DECREF(list);
+	}
+	else
+	{
+		PyObject *str = PyObject_Str(obj), *bytes = NULL;
+		const char *s = str ? python_to_c_string(str, &bytes) : NULL;
+		if (s != NULL)
+			json_append_string(buf, s, bytes ? (size_t)PyBytes_GET_SIZE(bytes) : strlen(s));
+		Py_XDECREF(bytes);
+		Py_XDECREF(str);
+		if (s == NULL)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Append the value of a field of the ``job_descriptor`` struct
+ */
+static void json_append_struct_field(struct byte_buffer *buf, const struct job_descriptor *job_desc,
+									 const struct job_desc_field *field)
+{
+	switch (field->kind)
+	{
+	case DESC_STRING:
+	{
+		const char *str = *job_desc_member(job_desc, field, char *const);
+		if (str == NULL)
+			buffer_append_literal(buf, "null");
 		else
+			json_append_string(buf, str, strlen(str));
+		break;
+	}
+	case DESC_STRING_LIST:
+	case DESC_ENVIRONMENT:
+	{
+		char **list = *job_desc_member(job_desc, field, char **const);
+		uint32_t count = *(const uint32_t *)((const char *)job_desc + field->count_offset);
+		if (list == NULL)
 		{
-			// Key has been removed by the user so remove it from the job descriptor
-			xfree((*str_list_p)[i]);
-			(*str_list_p)[i] = NULL;
+			buffer_append_literal(buf, "null");
+			break;
+		}
+		buffer_append(buf, field->kind == DESC_ENVIRONMENT ? "{" : "[", 1);
+		for (uint32_t j = 0; j < count; ++j)
+		{
+			if (j)
+				buffer_append_literal(buf, ",");
+			const char *eq = field->kind == DESC_ENVIRONMENT ? xstrchr(list[j], '=') : NULL;
+			if (field->kind == DESC_ENVIRONMENT)
+			{
+				json_append_string(buf, list[j], eq ? (size_t)(eq - list[j]) : strlen(list[j]));
+				buffer_append_literal(buf, ":");
+				eq = eq ? eq + 1 : "";
+				json_append_string(buf, eq, strlen(eq));
+			}
+			else
+				json_append_string(buf, list[j], strlen(list[j]));
 		}
+		buffer_append(buf, field->kind == DESC_ENVIRONMENT ? "}" : "]", 1);
+		break;
+	}
+	case DESC_TIME:
+	{
+		char number[24];
+		buffer_append(buf, number, snprintf(number, sizeof(number), "%lld",
+									 (long long)*job_desc_member(job_desc, field, const time_t)));
+		break;
+	}
+	case DESC_UINT:
+	case DESC_BOOL:
+	case DESC_FLAGS:
+	case DESC_MEMORY:
+	{
+		uint64_t value = job_desc_get_uint(job_desc, field);
+		if (value == no_val_of_size(field->size))
+			buffer_append_literal(buf, "null");
+		else if (field->kind == DESC_BOOL)
+			buffer_append(buf, value ? "true" : "false", value ? 4 : 5);
+		else
+			json_append_uint(buf, value);
+		break;
 	}
+	case DESC_VIEW:
+		buffer_append_literal(buf, "null");
+		break;
+	}
+}
+
+/*
+ * Append field ``i`` of a ``slurm.JobDescriptor``, from the struct unless the
+ * policy may have changed it
+ */
+static bool json_append_field(struct byte_buffer *buf, JobDescriptorObject *self, int i)
+{
+	const struct job_desc_field *field = &job_desc_fields[i];
+	bool container = field->kind == DESC_STRING_LIST || field->kind == DESC_ENVIRONMENT;
+
+	json_append_string(buf, field->name, strlen(field->name));
+	buffer_append_literal(buf, ":");
+
+	if (self->values[i] != NULL && (job_desc_assigned(self, i) || container))
+		return json_append_python(buf, self->values[i], 0);
 
-	// If we have removed entries from str_list_p, we must defragment it to move the gaps to the end
-	defragment_array(*num_strings_p, *str_list_p);
+	json_append_struct_field(buf, self->job_desc, field);
+	return true;
+}
 
-	// resize str_list_p to the original size of the dict with realloc
-	*num_strings_p = p_length;
-	*str_list_p = xrealloc(*str_list_p, (*num_strings_p) * sizeof(char *));
+/*
+ * Serialize the fields of a ``slurm.JobDescriptor`` as a JSON object, all of
+ * them unless ``fields`` names some. Fields the policy has not touched are
+ * written straight from the ``job_descriptor`` struct, so nothing needs to be
+ * converted to Python objects first.
+ */
+static PyObject *py_slurm_to_json(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"job_desc", "fields", NULL};
+	PyObject *obj, *fields = Py_None, *seq = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", keywords, &obj, &fields))
+		return NULL;
 
-	// Slot in the remaining elements of the dict into the string list
-	PyObject *remaining_items = PyMapping_Items(obj);
-	for (int i = 0; i < PyMapping_Length(remaining_items); ++i)
+	if (JobDescriptorType == NULL || !PyObject_TypeCheck(obj, JobDescriptorType))
 	{
-		PyObject *item = PyList_GetItem(remaining_items, i);
-		const char *key = PyUnicode_AsUTF8(PyTuple_GetItem(item, 0));
-		PyObject *p_value = PyTuple_GetItem(item, 1);
-		PyObject *p_str = PyObject_Str(p_value);
-		Py_DECREF(p_value);
+		PyErr_Format(PyExc_TypeError, "expected a JobDescriptor, not %s", Py_TYPE(obj)->tp_name);
+		return NULL;
+	}
+	JobDescriptorObject *desc = (JobDescriptorObject *)obj;
+	if (!check_generation(desc->generation))
+		return NULL;
+	if (fields != Py_None && (seq = PySequence_Fast(fields, "fields must be an iterable of names")) == NULL)
+		return NULL;
 
-		const int new_index = (*num_strings_p) - PyMapping_Length(obj) + i;
+	bool ok = true, first = true;
+	struct byte_buffer *buf = &json_buffer;
+	buf->len = 0;
+	buffer_append_literal(buf, "{");
+	Py_ssize_t count = seq ? PySequence_Fast_GET_SIZE(seq) : (Py_ssize_t)JOB_DESC_FIELD_COUNT;
+	for (Py_ssize_t n = 0; ok && n < count; ++n)
+	{
+		int i = seq ? job_descriptor_key(PySequence_Fast_GET_ITEM(seq, n)) : n;
+		if (i < 0)
+		{
+			ok = false;
+			break;
+		}
+		// Views hold no data of their own
+		if (job_desc_fields[i].kind == DESC_VIEW)
+		{
+			if (seq)
+			{
+				PyErr_Format(PyExc_ValueError, "%s cannot be serialized", job_desc_fields[i].name);
+				ok = false;
+			}
+			continue;
+		}
 
-		(*str_list_p)[new_index] = xstrdup_printf("%s=%s", key, PyUnicode_AsUTF8(p_str));
+		if (!first)
+			buffer_append_literal(buf, ",");
+		first = false;
+		ok = json_append_field(buf, desc, i);
 	}
-	Py_DECREF(remaining_items);
+	buffer_append_literal(buf, "}");
+	Py_XDECREF(seq);
+
+	return ok ? PyUnicode_DecodeUTF8(buf->data, buf->len, NULL) : NULL;
 }
 
-void python_to_char_star_star(PyObject *obj, uint32_t *num_strings_p, char ***str_list_p)
+/*
+ * Release the buffer of ``slurm.to_json()``
+ */
+static void json_buffer_free(void)
 {
-	if (obj == Py_None)
+	xfree(json_buffer.data);
+	json_buffer.len = json_buffer.size = 0;
+}
+
+/*
+ * Audit trail of submission decisions. ``job_submit()`` encodes a record of
+ * each decision and appends it to ``audit.pending``. A background thread
+ * writes everything pending with a single write, so records queued while it
+ * writes are committed together, syncs the file every ``audit_sync_interval``
+ * seconds and rotates it once it reaches ``audit_max_size``.
+ *
+ * The file starts with ``AUDIT_MAGIC``, followed by records of a little
+ * endian ``uint32`` length and the record:
+ *
+ *   uint8  version         AUDIT_VERSION
+ *   uint64 time            microseconds since the epoch
+ *   uint32 submit_uid
+ *   int32  rc              the decision returned to Slurm
+ *   uint32 latency         microseconds spent in job_submit()
+ *   uint8  flags           AUDIT_FLAG_*
+ *   uint16 entries, each
+ *     uint8  type          AUDIT_ENTRY_*
+ *     uint16 length, name of the field
+ *     uint32 length, JSON value (the value before the change for a change)
+ *     uint32 length, JSON value after the change, for a change only
+ *
+ * ``tools/job_submit_audit.py`` prints the records as JSON lines.
+ */
+#define AUDIT_MAGIC "SLJSAUD1"
+#define AUDIT_VERSION 1
+#define AUDIT_FLAG_SHED 0x01
+#define AUDIT_FLAG_SHADOW 0x02 // decision of the shadow policy, recorded when it disagrees
+#define AUDIT_ENTRY_FIELD 'f'
+#define AUDIT_ENTRY_CHANGE 'c'
+// Records are dropped rather than queued beyond this
+#define AUDIT_MAX_PENDING (64 * 1024 * 1024)
+
+// Fields recorded with every decision, as accepted
+static const char *audit_fields[] = {
+		"user_id",
+		"group_id",
+		"account",
+		"partition",
+		"qos",
+		"name",
+		"time_limit",
+		"min_nodes",
+		"num_tasks",
+		"cpus_per_task",
+		"pn_min_memory",
+		"licenses",
+#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
+		"tres_per_node",
+#endif
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	struct byte_buffer pending;
+	uint64_t pending_records;
+	int fd;
+	off_t size;
+} audit = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .fd = -1};
+
+static uint64_t time_us(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void buffer_put_uint(struct byte_buffer *buf, uint64_t value, int bytes)
+{
+	buffer_reserve(buf, bytes);
+	for (int i = 0; i < bytes; ++i)
+		buf->data[buf->len++] = (char)(value >> (8 * i));
+}
+
+static void buffer_patch_uint32(struct byte_buffer *buf, size_t offset, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		buf->data[offset + i] = (char)(value >> (8 * i));
+}
+
+static void audit_put_name(struct byte_buffer *buf, char type, const char *name)
+{
+	size_t len = strlen(name);
+	buffer_put_uint(buf, (unsigned char)type, 1);
+	buffer_put_uint(buf, len, 2);
+	buffer_append(buf, name, len);
+}
+
+/*
+ * Append the length-prefixed JSON value of ``field`` as it is in the struct,
+ * returning the offset of the value
+ */
+static size_t audit_put_value(struct byte_buffer *buf, const struct job_descriptor *job_desc,
+							  const struct job_desc_field *field)
+{
+	size_t offset = buf->len;
+	buffer_put_uint(buf, 0, 4);
+	json_append_struct_field(buf, job_desc, field);
+	buffer_patch_uint32(buf, offset, buf->len - offset - 4);
+	return offset + 4;
+}
+
+/*
+ * Open the audit file for appending, writing the header if it is new
+ */
+static int audit_open(void)
+{
+	int fd = open(audit_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0)
 	{
-		clear_char_star_star(num_strings_p, str_list_p);
-		return;
+		error("job_submit/python: Could not open audit log %s: %m", audit_file);
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
 
-	PyObject *list = PySequence_Fast(obj, "attribute is not a sequence");
-
-	if (list == NULL)
+	audit.size = st.st_size;
+	if (audit.size == 0)
 	{
-		print_python_error();
-		clear_char_star_star(num_strings_p, str_list_p);
-		return;
+		if (write(fd, AUDIT_MAGIC, sizeof(AUDIT_MAGIC) - 1) != sizeof(AUDIT_MAGIC) - 1)
+			error("job_submit/python: Could not write audit log %s: %m", audit_file);
+		audit.size = sizeof(AUDIT_MAGIC) - 1;
 	}
+	return fd;
+}
 
-	int python_count = PySequence_Fast_GET_SIZE(list);
+/*
+ * Move the audit file to ``<file>.1``, shifting older ones up to
+ * ``<file>.<audit_keep>``, and start a new one
+ */
+static void audit_rotate(void)
+{
+	fdatasync(audit.fd);
+	close(audit.fd);
 
-	// If the list is empty, set the array to NULL
-	if (python_count == 0)
+	for (uint32_t i = audit_keep; i > 0; --i)
 	{
-		clear_char_star_star(num_strings_p, str_list_p);
-		return;
+		char *from = i > 1 ? xstrdup_printf("%s.%u", audit_file, i - 1) : xstrdup(audit_file);
+		char *to = xstrdup_printf("%s.%u", audit_file, i);
+		if (rename(from, to) < 0 && errno != ENOENT)
+			error("job_submit/python: Could not rotate audit log %s: %m", from);
+		xfree(from);
+		xfree(to);
 	}
+	if (audit_keep == 0)
+		unlink(audit_file);
+
+	audit.fd = audit_open();
+}
+
+static void *audit_thread(void *arg)
+{
+	struct byte_buffer writing = {NULL, 0, 0};
+	uint64_t last_sync = time_us(CLOCK_MONOTONIC);
+	bool dirty = false;
+
+	slurm_mutex_lock(&audit.lock);
+	while (true)
+	{
+		if (audit.pending.len == 0 && !audit.stop && audit_sync_interval == 0)
+			pthread_cond_wait(&audit.cond, &audit.lock);
+		else if (audit.pending.len == 0 && !audit.stop)
+		{
+			// Wake up in time to sync what was written
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += audit_sync_interval;
+			pthread_cond_timedwait(&audit.cond, &audit.lock, &deadline);
+		}
+		if (audit.pending.len == 0 && audit.stop)
+			break;
+
+		struct byte_buffer swap = writing;
+		writing = audit.pending;
+		audit.pending = swap;
+		audit.pending.len = 0;
+		uint64_t records = audit.pending_records;
+		audit.pending_records = 0;
+		slurm_mutex_unlock(&audit.lock);
+
+		if (writing.len && audit.fd < 0)
+			audit.fd = audit_open();
+		if (writing.len && audit.fd >= 0)
+		{
+			const char *p = writing.data;
+			size_t left = writing.len;
+			while (left > 0)
+			{
+				ssize_t n = write(audit.fd, p, left);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0)
+				{
+					error("job_submit/python: Could not write audit log %s: %m", audit_file);
+					break;
+				}
+				p += n;
+				left -= n;
+			}
+			audit.size += writing.len - left;
+			dirty = true;
+			__atomic_add_fetch(left ? &stat_audit_dropped : &stat_audit_records, records, __ATOMIC_RELAXED);
+		}
+		else if (writing.len)
+			__atomic_add_fetch(&stat_audit_dropped, records, __ATOMIC_RELAXED);
+		writing.len = 0;
 
-	// If some entries have been removed the we should clear the memory that we will not need
-	if (python_count < (*num_strings_p))
-	{
-		for (int i = python_count; i < *num_strings_p; ++i)
+		uint64_t now = time_us(CLOCK_MONOTONIC);
+		if (audit.fd >= 0 && dirty && now - last_sync >= (uint64_t)audit_sync_interval * 1000000)
 		{
-			xfree((*str_list_p)[i]);
+			fdatasync(audit.fd);
+			last_sync = now;
+			dirty = false;
 		}
+		if (audit.fd >= 0 && audit_max_size && audit.size >= audit_max_size)
+			audit_rotate();
+
+		slurm_mutex_lock(&audit.lock);
 	}
+	slurm_mutex_unlock(&audit.lock);
 
-	// If there are more Pytohn strings than entries in the array then we
-	// must make the array larger to the correct amount
-	if (python_count != (*num_strings_p))
+	if (audit.fd >= 0)
 	{
-		*num_strings_p = python_count;
-		*str_list_p = xrealloc(*str_list_p, sizeof(char *) * (*num_strings_p));
+		fdatasync(audit.fd);
+		close(audit.fd);
+		audit.fd = -1;
 	}
+	xfree(writing.data);
+	return NULL;
+}
 
-	// Fill the array with the values from the list
-	for (int i = 0; i < python_count; ++i)
-	{
-		PyObject *obj = PySequence_Fast_GET_ITEM(list, i);
-		PyObject *str = PyObject_Str(obj);
-		const char *s = PyUnicode_AsUTF8(str);
+/*
+ * Start the writer if an audit log is configured
+ */
+static void audit_start(void)
+{
+	if (audit_file == NULL)
+		return;
 
-		(*str_list_p)[i] = xstrdup(s);
+	// Relative names are kept in the controller's state directory
+	if (audit_file[0] != '/')
+	{
+		char *path = xstrdup_printf("%s/%s", controller_conf.state_save_location, audit_file);
+		xfree(audit_file);
+		audit_file = path;
+	}
 
-		Py_DECREF(str);
+	audit.stop = false;
+	audit.fd = audit_open();
+	if (pthread_create(&audit.thread, NULL, audit_thread, NULL) != 0)
+	{
+		error("job_submit/python: Could not start the audit log writer");
+		return;
 	}
+	audit.running = true;
+}
 
-	Py_DECREF(list);
-	print_python_error(); // If there was one
+/*
+ * Write the remaining records and stop the writer
+ */
+static void audit_stop(void)
+{
+	if (!audit.running)
+		return;
+
+	slurm_mutex_lock(&audit.lock);
+	audit.stop = true;
+	pthread_cond_signal(&audit.cond);
+	slurm_mutex_unlock(&audit.lock);
+	pthread_join(audit.thread, NULL);
+	audit.running = false;
+	xfree(audit.pending.data);
+	audit.pending.size = 0;
 }
 
-#define retrieve_char_star(job_desc, dict, name)                      \
-	do                                                                  \
-	{                                                                   \
-		PyObject *o = PyDict_GetItemString(dict, #name);                  \
-		if (o != NULL)                                                    \
-		{                                                                 \
-			if (o == Py_None)                                               \
-			{                                                               \
-				job_desc->name = NULL;                                        \
-			}                                                               \
-			else                                                            \
-			{                                                               \
-				const char *s = PyUnicode_AsUTF8(o);                          \
-				if (job_desc->name == NULL || strcmp(s, job_desc->name) != 0) \
-				{                                                             \
-					xfree(job_desc->name);                                      \
-					job_desc->name = xstrdup(s);                                \
-				}                                                             \
-			}                                                               \
-			PyDict_DelItemString(dict, #name);                              \
-		}                                                                 \
-	} while (0)
-#define retrieve_char_star_star(job_desc, dict, name, count)          \
-	do                                                                  \
-	{                                                                   \
-		PyObject *o = PyDict_GetItemString(dict, #name);                  \
-		if (o != NULL)                                                    \
-		{                                                                 \
-			python_to_char_star_star(o, &job_desc->count, &job_desc->name); \
-			PyDict_DelItemString(dict, #name);                              \
-		}                                                                 \
-	} while (0)
-#define retrieve_environment_dict(job_desc, dict, name, count)          \
-	do                                                                    \
-	{                                                                     \
-		PyObject *o = PyDict_GetItemString(dict, #name);                    \
-		if (o != NULL)                                                      \
-		{                                                                   \
-			python_dict_to_environment(o, &job_desc->count, &job_desc->name); \
-			PyDict_DelItemString(dict, #name);                                \
-		}                                                                   \
-	} while (0)
-#define retrieve_int(job_desc, dict, name, noval)    \
-	do                                                 \
-	{                                                  \
-		PyObject *o = PyDict_GetItemString(dict, #name); \
-		if (o != NULL)                                   \
-		{                                                \
-			if (o == Py_None)                              \
-			{                                              \
-				job_desc->name = noval;                      \
-			}                                              \
-			else                                           \
-			{                                              \
-				job_desc->name = PyLong_AsUnsignedLong(o);   \
-			}                                              \
-			PyDict_DelItemString(dict, #name);             \
-		}                                                \
-	} while (0)
-#define retrieve_uint8_t(job_desc, dict, name) retrieve_int(job_desc, dict, name, NO_VAL8)
-#define retrieve_uint16_t(job_desc, dict, name) retrieve_int(job_desc, dict, name, NO_VAL16)
-#define retrieve_uint32_t(job_desc, dict, name) retrieve_int(job_desc, dict, name, NO_VAL)
-#define retrieve_uint64_t(job_desc, dict, name) retrieve_int(job_desc, dict, name, NO_VAL64)
-#define retrieve_int_as_bool(job_desc, dict, name, noval) \
-	do                                                      \
-	{                                                       \
-		PyObject *o = PyDict_GetItemString(dict, #name);      \
-		if (o != NULL)                                        \
-		{                                                     \
-			if (o == Py_None)                                   \
-			{                                                   \
-				job_desc->name = noval;                           \
-			}                                                   \
-			else                                                \
-			{                                                   \
-				job_desc->name = PyLong_AsUnsignedLong(o);        \
-			}                                                   \
-			PyDict_DelItemString(dict, #name);                  \
-		}                                                     \
-	} while (0)
-#define retrieve_uint8_t_as_bool(job_desc, dict, name) retrieve_int_as_bool(job_desc, dict, name, NO_VAL8)
-#define retrieve_uint16_t_as_bool(job_desc, dict, name) retrieve_int_as_bool(job_desc, dict, name, NO_VAL16)
-#define retrieve_time_t(job_desc, dict, name)        \
-	do                                                 \
-	{                                                  \
-		PyObject *o = PyDict_GetItemString(dict, #name); \
-		if (o != NULL)                                   \
-		{                                                \
-			job_desc->name = PyLong_AsUnsignedLong(o);     \
-			PyDict_DelItemString(dict, #name);             \
-		}                                                \
-	} while (0)
-
-/*
- * Turn a Python namespace object into a ``job_descriptor`` struct
- */
-void retrieve_job_desc_dict(struct job_descriptor *job_desc, PyObject *pJobDesc)
+/*
+ * Record the decision ``rc`` on ``job_desc``, with the ``change_count``
+ * changes encoded in ``changes`` by ``write_job_descriptor()``
+ */
+static void audit_record(const struct job_descriptor *job_desc, uint32_t submit_uid, int rc, uint64_t start,
+						 uint8_t flags, const struct byte_buffer *changes, uint16_t change_count)
 {
-#ifdef DEBUG
-	info("[retrieve_job_desc_dict] %s", "ENTRY");
-#endif
-	retrieve_char_star(job_desc, pJobDesc, account);
-	retrieve_char_star(job_desc, pJobDesc, acctg_freq);
-	retrieve_char_star(job_desc, pJobDesc, admin_comment);
-	retrieve_char_star(job_desc, pJobDesc, alloc_node);
-	retrieve_uint16_t(job_desc, pJobDesc, alloc_resp_port);
-	retrieve_uint32_t(job_desc, pJobDesc, alloc_sid);
-	retrieve_char_star_star(job_desc, pJobDesc, argv, argc);
-	retrieve_char_star(job_desc, pJobDesc, array_inx);
-	retrieve_time_t(job_desc, pJobDesc, begin_time);
-	retrieve_uint32_t(job_desc, pJobDesc, bitflags);
-	retrieve_char_star(job_desc, pJobDesc, burst_buffer);
-	retrieve_char_star(job_desc, pJobDesc, clusters);
-	retrieve_char_star(job_desc, pJobDesc, comment);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, contiguous);
-	retrieve_uint16_t(job_desc, pJobDesc, core_spec);
-	retrieve_char_star(job_desc, pJobDesc, cpu_bind);
-	retrieve_uint16_t(job_desc, pJobDesc, cpu_bind_type);
-	retrieve_uint32_t(job_desc, pJobDesc, cpu_freq_min);
-	retrieve_uint32_t(job_desc, pJobDesc, cpu_freq_max);
-	retrieve_uint32_t(job_desc, pJobDesc, cpu_freq_gov);
-	retrieve_time_t(job_desc, pJobDesc, deadline);
-	retrieve_uint32_t(job_desc, pJobDesc, delay_boot);
-	retrieve_char_star(job_desc, pJobDesc, dependency);
-	retrieve_time_t(job_desc, pJobDesc, end_time);
-	retrieve_environment_dict(job_desc, pJobDesc, environment, env_size);
-	retrieve_char_star(job_desc, pJobDesc, exc_nodes);
-	retrieve_char_star(job_desc, pJobDesc, features);
-	retrieve_uint32_t(job_desc, pJobDesc, group_id);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, immediate);
-	retrieve_uint32_t(job_desc, pJobDesc, job_id);
-	retrieve_char_star(job_desc, pJobDesc, job_id_str);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, kill_on_node_fail);
-	retrieve_char_star(job_desc, pJobDesc, licenses);
-	retrieve_uint16_t(job_desc, pJobDesc, mail_type);
-	retrieve_char_star(job_desc, pJobDesc, mail_user);
-	retrieve_char_star(job_desc, pJobDesc, mcs_label);
-	retrieve_char_star(job_desc, pJobDesc, mem_bind);
-	retrieve_uint16_t(job_desc, pJobDesc, mem_bind_type);
-	retrieve_char_star(job_desc, pJobDesc, name);
-	retrieve_char_star(job_desc, pJobDesc, network);
-	retrieve_uint32_t(job_desc, pJobDesc, nice);
-	retrieve_uint32_t(job_desc, pJobDesc, num_tasks);
-	retrieve_uint8_t(job_desc, pJobDesc, open_mode);
-	retrieve_uint16_t(job_desc, pJobDesc, other_port);
-	retrieve_uint8_t_as_bool(job_desc, pJobDesc, overcommit);
-	retrieve_char_star(job_desc, pJobDesc, partition);
-	retrieve_uint16_t(job_desc, pJobDesc, plane_size);
-	retrieve_uint8_t(job_desc, pJobDesc, power_flags);
-	retrieve_uint32_t(job_desc, pJobDesc, priority);
-	retrieve_uint32_t(job_desc, pJobDesc, profile);
-	retrieve_char_star(job_desc, pJobDesc, qos);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, reboot);
-	retrieve_char_star(job_desc, pJobDesc, resp_host);
-	retrieve_uint16_t(job_desc, pJobDesc, restart_cnt);
-	retrieve_char_star(job_desc, pJobDesc, req_nodes);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, requeue);
-	retrieve_char_star(job_desc, pJobDesc, reservation);
-	retrieve_char_star(job_desc, pJobDesc, script);
-	retrieve_uint16_t(job_desc, pJobDesc, shared);
-	retrieve_char_star_star(job_desc, pJobDesc, spank_job_env, spank_job_env_size);
-	retrieve_uint32_t(job_desc, pJobDesc, task_dist);
-	retrieve_uint32_t(job_desc, pJobDesc, time_limit);
-	retrieve_uint32_t(job_desc, pJobDesc, time_min);
-	retrieve_uint32_t(job_desc, pJobDesc, user_id);
-	retrieve_uint16_t_as_bool(job_desc, pJobDesc, wait_all_nodes);
-	retrieve_uint16_t(job_desc, pJobDesc, warn_flags);
-	retrieve_uint16_t(job_desc, pJobDesc, warn_signal);
-	retrieve_uint16_t(job_desc, pJobDesc, warn_time);
-	retrieve_char_star(job_desc, pJobDesc, work_dir);
-	retrieve_uint16_t(job_desc, pJobDesc, cpus_per_task);
-	retrieve_uint32_t(job_desc, pJobDesc, min_cpus);
-	retrieve_uint32_t(job_desc, pJobDesc, max_cpus);
-	retrieve_uint32_t(job_desc, pJobDesc, min_nodes);
-	retrieve_uint32_t(job_desc, pJobDesc, max_nodes);
-	retrieve_uint16_t(job_desc, pJobDesc, boards_per_node);
-	retrieve_uint16_t(job_desc, pJobDesc, sockets_per_board);
-	retrieve_uint16_t(job_desc, pJobDesc, sockets_per_node);
-	retrieve_uint16_t(job_desc, pJobDesc, cores_per_socket);
-	retrieve_uint16_t(job_desc, pJobDesc, threads_per_core);
-	retrieve_uint16_t(job_desc, pJobDesc, ntasks_per_node);
-	retrieve_uint16_t(job_desc, pJobDesc, ntasks_per_socket);
-	retrieve_uint16_t(job_desc, pJobDesc, ntasks_per_core);
-	retrieve_uint16_t(job_desc, pJobDesc, ntasks_per_board);
-	retrieve_uint16_t(job_desc, pJobDesc, pn_min_cpus);
-	retrieve_uint64_t(job_desc, pJobDesc, pn_min_memory);
-	retrieve_uint32_t(job_desc, pJobDesc, pn_min_tmp_disk);
-	retrieve_uint32_t(job_desc, pJobDesc, req_switch);
-	retrieve_char_star(job_desc, pJobDesc, std_err);
-	retrieve_char_star(job_desc, pJobDesc, std_in);
-	retrieve_char_star(job_desc, pJobDesc, std_out);
-	retrieve_uint32_t(job_desc, pJobDesc, wait4switch);
-	retrieve_char_star(job_desc, pJobDesc, wckey);
+	if (!audit.running)
+		return;
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 2, 0) && SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(17, 11, 0)
-	retrieve_uint64_t(job_desc, pJobDesc, fed_siblings);
-	retrieve_uint32_t(job_desc, pJobDesc, group_number);
-	retrieve_uint32_t(job_desc, pJobDesc, numpack);
-	retrieve_uint32_t(job_desc, pJobDesc, pack_leader);
-	retrieve_environment_dict(job_desc, pJobDesc, pelog_env, pelog_env_size);
-	retrieve_uint8_t(job_desc, pJobDesc, resv_port);
-#endif
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(17, 11, 0)
-	retrieve_char_star(job_desc, pJobDesc, cluster_features);
-	retrieve_char_star(job_desc, pJobDesc, extra);
-	retrieve_uint64_t(job_desc, pJobDesc, fed_siblings_active);
-	retrieve_uint64_t(job_desc, pJobDesc, fed_siblings_viable);
-	retrieve_char_star(job_desc, pJobDesc, origin_cluster);
-	retrieve_uint16_t(job_desc, pJobDesc, x11);
-	retrieve_char_star(job_desc, pJobDesc, x11_magic_cookie);
-	retrieve_uint16_t(job_desc, pJobDesc, x11_target_port);
-#endif
+	struct byte_buffer record = {NULL, 0, 0};
+	uint16_t entries = change_count;
 
-#if SLURM_VERSION_NUMBER < SLURM_VERSION_NUM(18, 8, 0)
-	retrieve_char_star(job_desc, pJobDesc, gres);
-#endif
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(18, 8, 0)
-	retrieve_char_star(job_desc, pJobDesc, batch_features);
-	retrieve_char_star(job_desc, pJobDesc, cpus_per_tres);
-	retrieve_char_star(job_desc, pJobDesc, mem_per_tres);
-	retrieve_char_star(job_desc, pJobDesc, tres_bind);
-	retrieve_char_star(job_desc, pJobDesc, tres_freq);
-	retrieve_char_star(job_desc, pJobDesc, tres_per_job);
-	retrieve_char_star(job_desc, pJobDesc, tres_per_node);
-	retrieve_char_star(job_desc, pJobDesc, tres_per_socket);
-	retrieve_char_star(job_desc, pJobDesc, tres_per_task);
-#endif
+	buffer_put_uint(&record, 0, 4);
+	buffer_put_uint(&record, AUDIT_VERSION, 1);
+	buffer_put_uint(&record, time_us(CLOCK_REALTIME), 8);
+	buffer_put_uint(&record, submit_uid, 4);
+	buffer_put_uint(&record, (uint32_t)rc, 4);
+	buffer_put_uint(&record, time_us(CLOCK_MONOTONIC) - start, 4);
+	buffer_put_uint(&record, flags, 1);
+	size_t entries_offset = record.len;
+	buffer_put_uint(&record, 0, 2);
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(19, 5, 0)
-	retrieve_uint32_t(job_desc, pJobDesc, site_factor);
-	retrieve_char_star(job_desc, pJobDesc, x11_target);
-#endif
+	for (size_t i = 0; i < sizeof(audit_fields) / sizeof(audit_fields[0]); ++i)
+	{
+		int field = job_desc_field_index(audit_fields[i]);
+		if (field < 0)
+			continue;
+		audit_put_name(&record, AUDIT_ENTRY_FIELD, audit_fields[i]);
+		audit_put_value(&record, job_desc, &job_desc_fields[field]);
+		entries++;
+	}
+	if (changes)
+		buffer_append(&record, changes->data, changes->len);
 
-#if SLURM_VERSION_NUMBER >= SLURM_VERSION_NUM(21, 0, 0)
-	retrieve_char_star(job_desc, pJobDesc, submit_line);
+	record.data[entries_offset] = (char)entries;
+	record.data[entries_offset + 1] = (char)(entries >> 8);
+	buffer_patch_uint32(&record, 0, record.len - 4);
+
+	slurm_mutex_lock(&audit.lock);
+	if (audit.pending.len + record.len > AUDIT_MAX_PENDING)
+		__atomic_add_fetch(&stat_audit_dropped, 1, __ATOMIC_RELAXED);
+	else
+	{
+		buffer_append(&audit.pending, record.data, record.len);
+		audit.pending_records++;
+		pthread_cond_signal(&audit.cond);
+	}
+	slurm_mutex_unlock(&audit.lock);
+	xfree(record.data);
+}
+
+/*
+ * Write the fields the policy assigned, and the lists and environments it
+ * may have edited in place, back into the ``job_descriptor`` struct. Fields
+ * whose value changed are encoded into ``changes`` for the audit log unless
+ * it is NULL.
+ */
+static void write_job_descriptor(PyObject *obj, struct byte_buffer *changes, uint16_t *change_count)
+{
+	JobDescriptorObject *self = (JobDescriptorObject *)obj;
+
+#ifdef DEBUG
+	info("[write_job_descriptor] %s", "ENTRY");
 #endif
+	for (size_t i = 0; i < JOB_DESC_FIELD_COUNT; ++i)
+	{
+		const struct job_desc_field *field = &job_desc_fields[i];
+		bool container = field->kind == DESC_STRING_LIST || field->kind == DESC_ENVIRONMENT;
+		if (self->values[i] == NULL || !(job_desc_assigned(self, i) || container))
+			continue;
+
+		if (changes == NULL)
+		{
+			job_desc_field_from_python(self->job_desc, field, self->values[i]);
+			continue;
+		}
 
+		size_t mark = changes->len;
+		audit_put_name(changes, AUDIT_ENTRY_CHANGE, field->name);
+		size_t before = audit_put_value(changes, self->job_desc, field);
+		job_desc_field_from_python(self->job_desc, field, self->values[i]);
+		size_t after = audit_put_value(changes, self->job_desc, field);
+		if (after - before - 4 == changes->len - after && !memcmp(changes->data + before, changes->data + after, changes->len - after))
+			changes->len = mark;
+		else
+			(*change_count)++;
+	}
 #ifdef DEBUG
-	info("[retrieve_job_desc_dict] %s", "RETURN");
+	info("[write_job_descriptor] %s", "RETURN");
 #endif
 }
 
 /*
- * Load the Python job-submit script and return it
+ * Load the Python policy module ``script_name`` and return it
  */
-PyObject *load_script()
+PyObject *load_script(const char *script_name)
 {
-	char script_name[] = "job_submit";
-
 	// Import the job_submit module
 	PyObject *pModuleInitial = PyImport_ImportModule(script_name);
 
@@ -937,108 +6147,529 @@ PyObject *load_script()
 }
 
 /*
- * Load and run the job submit script and call the ``job_submit`` function
+ * Add a ``name:module`` route of a PartitionScript or AccountScript option
  */
-extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg)
+static void add_policy_route(struct policy_routes *routes, const char *key, const char *value)
 {
-#ifdef DEBUG
-	info("[job_submit] pid=%ld, pyInitialized=%d\n", syscall(__NR_gettid), Py_IsInitialized());
-#endif
-	slurm_mutex_lock(&python_lock);
-	if (!Py_IsInitialized())
-		py_init();
+	const char *sep = xstrchr(value, ':');
+	if (!sep || sep == value || !sep[1])
+	{
+		error("job_submit/python: Invalid %s \"%s\", expected <name>:<module>", key, value);
+		return;
+	}
+
+	xrealloc(routes->route, (routes->count + 1) * sizeof(*routes->route));
+	routes->route[routes->count].name = xstrndup(value, sep - value);
+	routes->route[routes->count].script = xstrdup(sep + 1);
+	routes->count++;
+}
+
+static void free_policy_routes(struct policy_routes *routes)
+{
+	for (size_t i = 0; i < routes->count; ++i)
+	{
+		xfree(routes->route[i].name);
+		xfree(routes->route[i].script);
+	}
+	xfree(routes->route);
+	routes->count = 0;
+}
+
+/*
+ * Return the module of the route named ``name``, or of its first
+ * comma-separated entry, or NULL if no route matches
+ */
+static const char *find_policy_route(const struct policy_routes *routes, const char *name)
+{
+	if (!name)
+		return NULL;
+
+	size_t len = strcspn(name, ",");
+	for (size_t i = 0; i < routes->count; ++i)
+	{
+		if (strlen(routes->route[i].name) == len && !strncmp(routes->route[i].name, name, len))
+			return routes->route[i].script;
+	}
+	return NULL;
+}
+
+/*
+ * Pick the policy module of a submission: the module of its (first)
+ * partition, else the one of its account, else ``default_script``. Returns
+ * NULL when the job should be accepted without running any policy.
+ */
+static const char *select_policy(const struct job_descriptor *job_desc)
+{
+	const char *script = find_policy_route(&partition_scripts, job_desc->partition);
+	if (!script)
+		script = find_policy_route(&account_scripts, job_desc->account);
+	return script ? script : default_script;
+}
+
+/*
+ * Return the counters of the pipeline stage ``name``, adding them on first
+ * use. The caller holds ``python_lock``.
+ */
+static struct stage_stats *find_stage_stats(const char *name, size_t len)
+{
+	for (size_t i = 0; i < stage_stats_count; ++i)
+	{
+		if (strlen(stage_stats[i].name) == len && !strncmp(stage_stats[i].name, name, len))
+			return &stage_stats[i];
+	}
+
+	xrealloc(stage_stats, (stage_stats_count + 1) * sizeof(*stage_stats));
+	struct stage_stats *stats = &stage_stats[stage_stats_count++];
+	memset(stats, 0, sizeof(*stats));
+	stats->name = xstrndup(name, len);
+	return stats;
+}
+
+static void free_stage_stats(void)
+{
+	for (size_t i = 0; i < stage_stats_count; ++i)
+		xfree(stage_stats[i].name);
+	xfree(stage_stats);
+	stage_stats_count = 0;
+}
 
-	PyObject *pModule = NULL, *pFunc = NULL, *pRc = NULL, *pJobDesc = NULL;
+/*
+ * Call the ``job_submit`` function of one pipeline stage on ``pJobDesc``.
+ * Returns SLURM_SUCCESS, POLICY_STOP or the error rejecting the job.
+ */
+static int run_stage(const char *script_name, PyObject *pJobDesc, PyObject *p_submit_uid)
+{
+	PyObject *pModule = NULL, *pFunc = NULL, *pRc = NULL;
+	int result = SLURM_ERROR;
 
-	pModule = load_script();
+	pModule = load_script(script_name);
 	if (!pModule)
-		goto slurm_job_submit_error;
+		goto run_stage_return;
 
 	pFunc = PyObject_GetAttrString(pModule, "job_submit");
-	Py_DECREF(pModule);
-	pModule = NULL;
-
 	if (!(pFunc && PyCallable_Check(pFunc)))
 	{
 		error("job_submit/python: Call failed");
 		print_python_error();
-		goto slurm_job_submit_error;
+		goto run_stage_return;
 	}
 
-	pJobDesc = create_job_desc_dict(job_desc);
-	PyObject *p_submit_uid = PyLong_FromUnsignedLongLong(submit_uid);
 #ifdef DEBUG
-	info("[job_submit] BEGIN callFunctionObjArgs: %s", "job_submit");
+	info("[run_stage] BEGIN callFunctionObjArgs: %s", script_name);
 #endif
 	pRc = PyObject_CallFunctionObjArgs(pFunc, pJobDesc, p_submit_uid, NULL);
 #ifdef DEBUG
-	info("[job_submit] END callFunctionObjArgs: %s", "job_submit");
+	info("[run_stage] END callFunctionObjArgs: %s", script_name);
 #endif
-	Py_DECREF(pFunc);
-	pFunc = NULL;
-	Py_DECREF(p_submit_uid);
-	p_submit_uid = NULL;
-
 	if (!pRc)
 	{
 		error("job_submit/python: NULL pointer returned from function job_submit");
 		print_python_error();
-		goto slurm_job_submit_error;
+		goto run_stage_return;
 	}
 
 	if (!PyLong_Check(pRc))
 	{
 		error("job_submit/python: return value of function must be an integer, not %s", Py_TYPE(pRc)->tp_name);
-		goto slurm_job_submit_error;
+		goto run_stage_return;
+	}
+
+	long rc = PyLong_AsLong(pRc);
+	if (rc != SLURM_SUCCESS && rc != POLICY_STOP)
+	{
+		error("job_submit/python: non-zero return from \"%s\": %ld", script_name, rc);
+		goto run_stage_return;
+	}
+	result = rc;
+
+run_stage_return:
+	Py_XDECREF(pModule);
+	Py_XDECREF(pFunc);
+	Py_XDECREF(pRc);
+	return result;
+}
+
+/*
+ * Run the policy ``scripts``, a comma-separated list of modules, on
+ * ``job_desc``. The stages share one ``slurm.JobDescriptor`` so each sees
+ * the changes of the previous ones; a stage rejecting the job or returning
+ * ``slurm.STOP`` ends the pipeline. The changes are written back if the job
+ * is accepted, and encoded into ``changes`` unless it is NULL. Stage timings
+ * go to ``slurm.stats()`` when ``count_stages`` is set. The caller holds
+ * ``python_lock`` with the interpreter initialized.
+ */
+static int run_policy(const char *scripts, struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg,
+					  struct byte_buffer *changes, uint16_t *change_count, bool count_stages)
+{
+	int result = SLURM_ERROR;
+
+	current_job_desc = job_desc;
+	current_generation++;
+	PyObject *pJobDesc = create_job_descriptor(job_desc);
+	if (!pJobDesc)
+	{
+		error("job_submit/python: Could not create the job descriptor");
+		print_python_error();
+		goto run_policy_return;
+	}
+	PyObject *p_submit_uid = PyLong_FromUnsignedLongLong(submit_uid);
+
+	result = SLURM_SUCCESS;
+	for (const char *stage = scripts + strspn(scripts, ", "); *stage; stage += strspn(stage, ", "))
+	{
+		size_t len = strcspn(stage, ", ");
+		char *script_name = xstrndup(stage, len);
+		uint64_t start = time_us(CLOCK_MONOTONIC);
+		result = run_stage(script_name, pJobDesc, p_submit_uid);
+		xfree(script_name);
+
+		if (count_stages)
+		{
+			struct stage_stats *stats = find_stage_stats(stage, len);
+			uint64_t elapsed = time_us(CLOCK_MONOTONIC) - start;
+			stats->calls++;
+			stats->time_us += elapsed;
+			if (elapsed > stats->time_max_us)
+				stats->time_max_us = elapsed;
+			if (result == POLICY_STOP)
+				stats->stopped++;
+			else if (result != SLURM_SUCCESS)
+				stats->rejected++;
+		}
+
+		if (result != SLURM_SUCCESS)
+			break;
+		stage += len;
 	}
+	Py_DECREF(p_submit_uid);
 
 	if (user_msg)
 	{
 #ifdef DEBUG
-		info("[job_submit] received user_msg\n%s", user_msg);
+		info("[run_policy] received user_msg\n%s", user_msg);
 #endif
 		if (err_msg)
 			*err_msg = user_msg;
+		else
+			xfree(user_msg);
 		user_msg = NULL;
 	}
 
-	long rc = PyLong_AsLong(pRc);
-	Py_DECREF(pRc);
-	pRc = NULL;
+	if (result == POLICY_STOP)
+		result = SLURM_SUCCESS;
+	if (result == SLURM_SUCCESS)
+		write_job_descriptor(pJobDesc, changes, change_count);
+
+run_policy_return:
+	Py_XDECREF(pJobDesc);
+	// A message of a failed call is not for the next one
+	xfree(user_msg);
+	return result;
+}
+
+/*
+ * Shadow evaluation of a candidate policy. When ``shadow_script`` is set,
+ * ``job_submit()`` copies each descriptor before the live policy sees it and
+ * queues the copy with the live decision once that is returned. A background
+ * thread runs the candidate on the copy when no submission is waiting for
+ * the interpreter, under the controller read locks the policy functions
+ * need, and compares its decision and changes with the live ones. It never
+ * waits for the interpreter: when a submission gets there first, the thread
+ * gives way and tries again once the submissions have drained, so only a
+ * submission arriving while a candidate is already running waits for it.
+ */
+struct shadow_job
+{
+	struct shadow_job *next;
+	struct job_descriptor *job_desc; // copy of the submitted descriptor
+	uint32_t submit_uid;
+	int live_rc;
+	uint64_t live_latency;
+	struct byte_buffer live_changes;
+	uint16_t live_change_count;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	struct shadow_job *head;
+	struct shadow_job *tail;
+	uint32_t count;
+	uint64_t idle_seq; // bumped each time the last waiting submission is done
+} shadow = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void free_shadow_job(struct shadow_job *job)
+{
+	free_job_desc_copy(job->job_desc);
+	xfree(job->live_changes.data);
+	xfree(job);
+}
+
+/*
+ * Run the candidate policy on a queued copy and record how its decision
+ * differs from the live one. Return false without running it when a
+ * submission is waiting for, or holds, the interpreter.
+ */
+static bool shadow_evaluate(struct shadow_job *job)
+{
+	// Same order as job_submit(): the controller locks, then the interpreter
+	slurmctld_lock_t locks = {READ_LOCK, READ_LOCK, READ_LOCK, READ_LOCK};
+	struct byte_buffer changes = {NULL, 0, 0};
+	uint16_t change_count = 0;
 
-	if (rc != SLURM_SUCCESS)
+	lock_slurmctld(locks);
+	if (__atomic_load_n(&stat_queue_depth, __ATOMIC_RELAXED) > 0 || pthread_mutex_trylock(&python_lock))
 	{
-		error("job_submit/python: non-zero return: %ld", rc);
-		goto slurm_job_submit_error;
+		unlock_slurmctld(locks);
+		return false;
 	}
-	retrieve_job_desc_dict(job_desc, pJobDesc);
-	Py_DECREF(pJobDesc);
-	pJobDesc = NULL;
-
-#ifdef DEBUG
-	info("[job_submit] %s", "label/slurm_job_submit_success");
-#endif
+	uint64_t start = time_us(CLOCK_MONOTONIC);
+	if (!Py_IsInitialized())
+		py_init();
+	int rc = run_policy(shadow_script, job->job_desc, job->submit_uid, NULL, &changes, &change_count, false);
 	py_fini();
+	uint64_t latency = time_us(CLOCK_MONOTONIC) - start;
 	slurm_mutex_unlock(&python_lock);
-#ifdef DEBUG
-	info("[job_submit] %s", "SLURM_SUCCESS");
-#endif
-	return SLURM_SUCCESS;
+	unlock_slurmctld(locks);
+
+	__atomic_add_fetch(&stat_shadow_evaluated, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat_live_latency_us, job->live_latency, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat_shadow_latency_us, latency, __ATOMIC_RELAXED);
+
+	// Both change lists are in field order with the same old values
+	if (rc != job->live_rc || changes.len != job->live_changes.len ||
+		memcmp(changes.data, job->live_changes.data, changes.len))
+	{
+		__atomic_add_fetch(&stat_shadow_disagreed, 1, __ATOMIC_RELAXED);
+		info("job_submit/python: Shadow policy \"%s\" disagrees on a job of uid %u: rc %d and %u changes, live policy rc %d and %u changes",
+			 shadow_script, job->submit_uid, rc, change_count, job->live_rc, job->live_change_count);
+		audit_record(job->job_desc, job->submit_uid, rc, start, AUDIT_FLAG_SHADOW, &changes, change_count);
+	}
+	xfree(changes.data);
+	return true;
+}
+
+static void *shadow_thread(void *arg)
+{
+	struct shadow_job *job = NULL; // set while giving way to live submissions
+	uint64_t idle_seq = 0;
+
+	slurm_mutex_lock(&shadow.lock);
+	while (true)
+	{
+		// Live submissions go first: wait until the last one waiting is done
+		while (!shadow.stop &&
+			   (job ? shadow.idle_seq == idle_seq
+				   : (shadow.head == NULL || __atomic_load_n(&stat_queue_depth, __ATOMIC_RELAXED) > 0)))
+			pthread_cond_wait(&shadow.cond, &shadow.lock);
+		if (shadow.stop)
+			break;
+
+		if (job == NULL)
+		{
+			job = shadow.head;
+			shadow.head = job->next;
+			if (shadow.head == NULL)
+				shadow.tail = NULL;
+			shadow.count--;
+		}
+		idle_seq = shadow.idle_seq;
+		slurm_mutex_unlock(&shadow.lock);
+
+		if (shadow_evaluate(job))
+		{
+			free_shadow_job(job);
+			job = NULL;
+		}
+
+		slurm_mutex_lock(&shadow.lock);
+	}
+	slurm_mutex_unlock(&shadow.lock);
+	if (job)
+		free_shadow_job(job);
+	return NULL;
+}
+
+static void shadow_start(void)
+{
+	if (shadow_script == NULL)
+		return;
+
+	shadow.stop = false;
+	if (pthread_create(&shadow.thread, NULL, shadow_thread, NULL) != 0)
+	{
+		error("job_submit/python: Could not start the shadow policy thread");
+		return;
+	}
+	shadow.running = true;
+}
+
+/*
+ * Stop the shadow thread, dropping the copies not evaluated yet
+ */
+static void shadow_stop(void)
+{
+	if (!shadow.running)
+		return;
+
+	slurm_mutex_lock(&shadow.lock);
+	shadow.stop = true;
+	pthread_cond_signal(&shadow.cond);
+	slurm_mutex_unlock(&shadow.lock);
+	pthread_join(shadow.thread, NULL);
+	shadow.running = false;
+
+	while (shadow.head)
+	{
+		struct shadow_job *job = shadow.head;
+		shadow.head = job->next;
+		free_shadow_job(job);
+	}
+	shadow.tail = NULL;
+	shadow.count = 0;
+}
+
+/*
+ * Queue ``copy``, taken before the live policy ran, with the live decision.
+ * The queue holds the changes of the live policy and takes ownership of the
+ * copy.
+ */
+static void shadow_submit(struct job_descriptor *copy, uint32_t submit_uid, int rc, uint64_t start,
+						  struct byte_buffer *changes, uint16_t change_count)
+{
+	struct shadow_job *job = xmalloc(sizeof(*job));
+	job->job_desc = copy;
+	job->submit_uid = submit_uid;
+	job->live_rc = rc;
+	job->live_latency = time_us(CLOCK_MONOTONIC) - start;
+	job->live_changes = *changes;
+	job->live_change_count = change_count;
+	memset(changes, 0, sizeof(*changes));
+
+	slurm_mutex_lock(&shadow.lock);
+	if (shadow.count >= shadow_queue_depth)
+	{
+		slurm_mutex_unlock(&shadow.lock);
+		__atomic_add_fetch(&stat_shadow_dropped, 1, __ATOMIC_RELAXED);
+		free_shadow_job(job);
+		return;
+	}
+	if (shadow.tail)
+		shadow.tail->next = job;
+	else
+		shadow.head = job;
+	shadow.tail = job;
+	shadow.count++;
+	pthread_cond_signal(&shadow.cond);
+	slurm_mutex_unlock(&shadow.lock);
+}
+
+/*
+ * Wake the shadow thread when no submission is waiting for the interpreter
+ * any more
+ */
+static void shadow_idle(void)
+{
+	if (!shadow.running || __atomic_load_n(&stat_queue_depth, __ATOMIC_RELAXED) > 0)
+		return;
+
+	slurm_mutex_lock(&shadow.lock);
+	shadow.idle_seq++;
+	pthread_cond_signal(&shadow.cond);
+	slurm_mutex_unlock(&shadow.lock);
+}
+
+/*
+ * Count the calling thread as waiting for ``python_lock`` and return the new
+ * queue depth, keeping track of the high-water mark
+ */
+static uint32_t queue_depth_enter(void)
+{
+	uint32_t depth = __atomic_add_fetch(&stat_queue_depth, 1, __ATOMIC_RELAXED);
+	uint32_t max = __atomic_load_n(&stat_queue_depth_max, __ATOMIC_RELAXED);
+
+	while (depth > max &&
+		   !__atomic_compare_exchange_n(&stat_queue_depth_max, &max, depth, false,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	return depth;
+}
+
+/*
+ * Decide on a job natively, without waiting for Python, because too many
+ * submissions are already queued on ``python_lock``
+ */
+static int shed_job_submit(uint32_t queue_depth, uint32_t submit_uid, char **err_msg)
+{
+	if (shed_policy == SHED_POLICY_ACCEPT)
+	{
+		__atomic_add_fetch(&stat_shed_accepted, 1, __ATOMIC_RELAXED);
+		debug("job_submit/python: queue depth %u exceeds %u, accepting job from uid %u unchanged",
+			  queue_depth, shed_queue_depth, submit_uid);
+		return SLURM_SUCCESS;
+	}
+
+	__atomic_add_fetch(&stat_shed_rejected, 1, __ATOMIC_RELAXED);
+	debug("job_submit/python: queue depth %u exceeds %u, rejecting job from uid %u",
+		  queue_depth, shed_queue_depth, submit_uid);
+	if (err_msg)
+		*err_msg = xstrdup("Job submission policy is busy, please retry");
 
-slurm_job_submit_error:
+	// sbatch sleeps and resubmits when it receives EAGAIN
+	return EAGAIN;
+}
+
+/*
+ * Load and run the job submit script and call the ``job_submit`` function
+ */
+extern int job_submit(struct job_descriptor *job_desc, uint32_t submit_uid, char **err_msg)
+{
 #ifdef DEBUG
-	info("[job_submit] %s", "label/slurm_job_submit_error");
+	info("[job_submit] pid=%ld, pyInitialized=%d\n", syscall(__NR_gettid), Py_IsInitialized());
 #endif
-	Py_XDECREF(pModule);
-	Py_XDECREF(pFunc);
-	Py_XDECREF(pJobDesc);
-	Py_XDECREF(pRc);
-	py_fini();
+	uint64_t start = time_us(CLOCK_MONOTONIC);
+	uint32_t queue_depth = queue_depth_enter();
+	if (shed_queue_depth && queue_depth > shed_queue_depth)
+	{
+		__atomic_sub_fetch(&stat_queue_depth, 1, __ATOMIC_RELAXED);
+		shadow_idle();
+		int rc = shed_job_submit(queue_depth, submit_uid, err_msg);
+		audit_record(job_desc, submit_uid, rc, start, AUDIT_FLAG_SHED, NULL, 0);
+		return rc;
+	}
+
+	slurm_mutex_lock(&python_lock);
+	__atomic_sub_fetch(&stat_queue_depth, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat_submissions, 1, __ATOMIC_RELAXED);
+
+	struct byte_buffer changes = {NULL, 0, 0};
+	uint16_t change_count = 0;
+	struct job_descriptor *shadow_copy = shadow.running ? copy_job_desc(job_desc) : NULL;
+	bool record = audit.running || shadow_copy;
+	const char *script = select_policy(job_desc);
+	int rc = SLURM_SUCCESS;
+	if (script)
+	{
+		if (!Py_IsInitialized())
+			py_init();
+		rc = run_policy(script, job_desc, submit_uid, err_msg, record ? &changes : NULL, &change_count, true);
+		py_fini();
+	}
 	slurm_mutex_unlock(&python_lock);
+	audit_record(job_desc, submit_uid, rc, start, 0, &changes, change_count);
+	if (shadow_copy)
+		shadow_submit(shadow_copy, submit_uid, rc, start, &changes, change_count);
+	shadow_idle();
+	xfree(changes.data);
 #ifdef DEBUG
-	info("[job_submit] %s", "SLURM_ERROR");
+	info("[job_submit] %s", rc == SLURM_SUCCESS ? "SLURM_SUCCESS" : "SLURM_ERROR");
 #endif
-	return SLURM_ERROR;
+	return rc;
 }
 
 extern int job_modify(struct job_descriptor *job_desc, struct job_record *job_ptr, uint32_t submit_uid)
@@ -0,0 +1,66 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit_python.conf
+ShedQueueDepth=1
+ShedPolicy=accept
+EOF
+supervisorctl restart slurmctld
+sleep 2
+
+# The "hold" job keeps the interpreter busy until a submission has been shed,
+# so the result does not depend on how fast the others reach the plugin
+rm -f /tmp/job_submit_shed.holding
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+import time
+def job_submit(job_desc, submit_uid):
+    if job_desc.name == "hold":
+        open("/tmp/job_submit_shed.holding", "w").close()
+        deadline = time.time() + 60
+        while slurm.stats()["shed_accepted"] == 0 and time.time() < deadline:
+            time.sleep(0.1)
+    return 0
+EOF
+
+sbatch --job-name=hold <<EOF &
+#! /bin/bash
+hostname
+EOF
+for i in $(seq 1 60); do
+    if [[ -e /tmp/job_submit_shed.holding ]]; then break; fi
+    sleep 1
+done
+
+for i in 1 2 3 4; do
+sbatch <<EOF &
+#! /bin/bash
+hostname
+EOF
+done
+wait
+rm -f /tmp/job_submit_shed.holding
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("shed_accepted=%(shed_accepted)d" % slurm.stats())
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+sleep 2
+
+scancel -u root
+
+if [[ $MESSAGE == *"shed_accepted=0"* ]]; then echo "No submission was shed: $MESSAGE"; exit 1; fi
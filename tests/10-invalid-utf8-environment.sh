@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg(ascii(job_desc['environment']['BAD_BYTES']))
+    return 0
+EOF
+
+MESSAGE=$(
+BAD_BYTES=$'caf\xe9' sbatch 2>&1 <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+
+scancel -u root
+
+if [[ $MESSAGE != *"caf\\udce9"* ]]; then echo "Invalid UTF-8 not passed with surrogateescape: $MESSAGE"; exit 1; fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    hosts = slurm.hostlist_expand("gpu[001-128],login1")
+    slurm.user_msg("count=%d" % len(hosts))
+    slurm.user_msg("first=%s" % next(iter(hosts)))
+    slurm.user_msg("contains=%s" % slurm.hostlist_contains(hosts, "gpu064"))
+    slurm.user_msg("intersect=%s" % slurm.hostlist_intersect(hosts, "gpu[120-140]"))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"count=129"* ]]; then echo "Wrong host count: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"first=gpu001"* ]]; then echo "Wrong first host: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"contains=True"* ]]; then echo "Host not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"intersect=gpu[120-128]"* ]]; then echo "Wrong intersection: $MESSAGE"; exit 1; fi
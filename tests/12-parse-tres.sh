@@ -0,0 +1,25 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    req = slurm.parse_tres("gres/gpu:a100:4")[0]
+    slurm.user_msg("parsed=%(name)s,%(model)s,%(count)d" % req)
+    slurm.user_msg("per_node=%r" % job_desc['tres'].per_node)
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --gres=gpu:2 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"parsed=gpu,a100,4"* ]]; then echo "TRES string not parsed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"'name': 'gpu'"* ]]; then echo "tres view not parsed: $MESSAGE"; exit 1; fi
@@ -0,0 +1,27 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    decoded = job_desc['decoded']
+    slurm.user_msg("mem=%(mb)d,%(per_cpu)s" % decoded.pn_min_memory)
+    slurm.user_msg("mail=%s" % ",".join(sorted(decoded.mail_type)))
+    job_desc['mail_type'] = decoded.mail_type | {"FAIL"}
+    job_desc['pn_min_memory'] = {"mb": 2048, "per_node": True}
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --mem-per-cpu=100 --mail-type=BEGIN,END 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"mem=100,True"* ]]; then echo "pn_min_memory not decoded: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"mail=BEGIN,END"* ]]; then echo "mail_type not decoded: $MESSAGE"; exit 1; fi
@@ -0,0 +1,30 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    for name, value in slurm.script_directives(job_desc):
+        slurm.user_msg("directive=%s:%s" % (name, value))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+#SBATCH --time=10 -N 2
+#SBATCH --exclusive # whole node
+hostname
+#SBATCH --comment=ignored
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"directive=time:10"* ]]; then echo "--time not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"directive=N:2"* ]]; then echo "-N not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"directive=exclusive:None"* ]]; then echo "--exclusive not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE == *"directive=comment"* ]]; then echo "directive after commands parsed: $MESSAGE"; exit 1; fi
@@ -0,0 +1,26 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+FORBIDDEN = slurm.compile_patterns(["rm -rf /", "LD_PRELOAD"], ignore_case=True)
+def job_submit(job_desc, submit_uid):
+    for field, pattern in FORBIDDEN.scan(job_desc):
+        slurm.user_msg("forbidden=%s:%s" % (field, pattern))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+LD_PRELOAD= sbatch --export=ALL 2>&1 <<EOF
+#! /bin/bash
+RM -RF /tmp/scratch
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"forbidden=script:rm -rf /"* ]]; then echo "script pattern not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"forbidden=environment:LD_PRELOAD"* ]]; then echo "environment pattern not found: $MESSAGE"; exit 1; fi
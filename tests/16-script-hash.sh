@@ -0,0 +1,24 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    if slurm.script_hash(job_desc) == slurm.script_hash(job_desc['script']):
+        slurm.user_msg("hash=consistent")
+    slurm.user_msg("sha256=%s" % slurm.script_sha256(job_desc))
+    return 1
+EOF
+
+SCRIPT=$'#! /bin/bash\nhostname\n'
+EXPECTED=$(printf '%s' "$SCRIPT" | sha256sum | cut -d' ' -f1)
+
+set +e
+MESSAGE=$(printf '%s' "$SCRIPT" | sbatch 2>&1)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"hash=consistent"* ]]; then echo "script hash differs: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"sha256=$EXPECTED"* ]]; then echo "wrong sha256: $MESSAGE"; exit 1; fi
@@ -0,0 +1,23 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    array = slurm.parse_array(job_desc['array_inx'])
+    slurm.user_msg("array=%(count)d,%(min)d,%(max)d,%(step)d,%(throttle)d" % array)
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --array=1-99:2%5 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"array=50,1,99,2,5"* ]]; then echo "array index not parsed: $MESSAGE"; exit 1; fi
@@ -0,0 +1,33 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    if job_desc['dependency'] is None:
+        return 0
+    for dep in slurm.parse_dependency(job_desc['dependency'], check_jobs=True)['dependencies']:
+        slurm.user_msg("dependency=%(type)s,%(job_id)d,%(exists)s" % dep)
+    return 1
+EOF
+
+JID=$(
+sbatch --parsable --hold <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+
+set +e
+MESSAGE=$(
+sbatch --dependency="afterok:$JID:4000000000" 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"dependency=afterok,$JID,True"* ]]; then echo "existing job not found: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"dependency=afterok,4000000000,False"* ]]; then echo "unknown job reported: $MESSAGE"; exit 1; fi
@@ -0,0 +1,23 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    res = job_desc['resources']
+    slurm.user_msg("resources=%d,%d,%d,%d" % (res.tasks, res.cpus, res.memory_mb, res.tres_minutes['cpu']))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --ntasks=4 --cpus-per-task=2 --mem-per-cpu=100 --time=10 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"resources=4,8,800,80"* ]]; then echo "wrong resource totals: $MESSAGE"; exit 1; fi
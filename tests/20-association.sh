@@ -0,0 +1,27 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+# Without accounting storage there is no association, which must read as None
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    assoc = slurm.association(submit_uid)
+    if assoc is None:
+        slurm.user_msg("association=none")
+    else:
+        slurm.user_msg("association=%s,%s" % (assoc.account, assoc.used_jobs))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"association=none"* ]]; then echo "Expected no association without accounting storage: $MESSAGE"; exit 1; fi
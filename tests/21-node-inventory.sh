@@ -0,0 +1,31 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    inventory = slurm.node_inventory()
+    slurm.user_msg("nodes=%d" % inventory['nodes'])
+    for partition in inventory['partitions']:
+        slurm.user_msg("partition=%s,%d" % (partition, slurm.node_inventory(partition)['nodes']))
+    if slurm.node_inventory("no-such-partition") is None:
+        slurm.user_msg("unknown=None")
+    return 1
+EOF
+
+NODES=$(sinfo --noheader --Format nodehost | sort -u | wc -l)
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"nodes=$NODES"* ]]; then echo "expected $NODES nodes: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"partition="* ]]; then echo "no partition listed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"unknown=None"* ]]; then echo "unknown partition not None: $MESSAGE"; exit 1; fi
@@ -0,0 +1,38 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    satisfiable, nodes = slurm.check_constraint("no_such_feature|!no_such_feature")
+    slurm.user_msg("any=%s,%d" % (satisfiable, nodes))
+    satisfiable, nodes = slurm.check_constraint("no_such_feature&(a|b)")
+    slurm.user_msg("none=%s,%d" % (satisfiable, nodes))
+    try:
+        slurm.check_constraint("a&(b")
+    except ValueError:
+        slurm.user_msg("invalid=ValueError")
+    try:
+        slurm.check_constraint("(" * 100000 + "a" + ")" * 100000)
+    except ValueError:
+        slurm.user_msg("nested=ValueError")
+    return 1
+EOF
+
+NODES=$(sinfo --noheader --Format nodehost | sort -u | wc -l)
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"any=True,$NODES"* ]]; then echo "tautology not satisfied on $NODES nodes: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"none=False,0"* ]]; then echo "unknown feature satisfied: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"invalid=ValueError"* ]]; then echo "syntax error not raised: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"nested=ValueError"* ]]; then echo "deep nesting not rejected: $MESSAGE"; exit 1; fi
@@ -0,0 +1,28 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+# The test cluster configures no licenses, so none of them is valid
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    licenses = slurm.parse_licenses(job_desc['licenses'], validate=True)
+    for license in licenses['licenses']:
+        slurm.user_msg("license=%(name)s,%(count)d,%(total)s" % license)
+    slurm.user_msg("valid=%s" % licenses['valid'])
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --licenses=matlab:2,ansys@db 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"license=matlab,2,None"* ]]; then echo "matlab license not parsed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"license=ansys@db,1,None"* ]]; then echo "ansys license not parsed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"valid=False"* ]]; then echo "unconfigured licenses reported valid: $MESSAGE"; exit 1; fi
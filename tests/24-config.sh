@@ -0,0 +1,27 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("cluster=%s" % slurm.config("ClusterName"))
+    slurm.user_msg("max_array_size=%d" % slurm.config()['MaxArraySize'])
+    return 1
+EOF
+
+CLUSTER=$(scontrol show config | awk '$1 == "ClusterName" { print $3 }')
+MAX_ARRAY_SIZE=$(scontrol show config | awk '$1 == "MaxArraySize" { print $3 }')
+
+set +e
+MESSAGE=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"cluster=$CLUSTER"* ]]; then echo "expected cluster $CLUSTER: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"max_array_size=$MAX_ARRAY_SIZE"* ]]; then echo "expected MaxArraySize $MAX_ARRAY_SIZE: $MESSAGE"; exit 1; fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    submitted = slurm.submit_options()
+    if submitted is None:
+        slurm.user_msg("submit_line=None")
+        return 1
+    for name, value in sorted(submitted['options'].items()):
+        slurm.user_msg("option=%s:%s" % (name, value))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch -N 1 --job-name "two words" --hold 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+# Slurm releases before 21.08 have no submit line
+if [[ $MESSAGE == *"submit_line=None"* ]]; then exit 0; fi
+if [[ $MESSAGE != *"option=nodes:1"* ]]; then echo "-N not parsed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"option=job-name:two words"* ]]; then echo "--job-name not parsed: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"option=hold:None"* ]]; then echo "--hold not parsed: $MESSAGE"; exit 1; fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("type=%s" % type(job_desc).__name__)
+    slurm.user_msg("name=%s,%s" % (job_desc.name, job_desc['name']))
+    job_desc['comment'] = "by item"
+    slurm.user_msg("comment=%s" % job_desc.comment)
+    slurm.user_msg("keys=%s" % ("partition" in job_desc and len(dict(job_desc)) == len(job_desc)))
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --job-name=attr 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *"type=JobDescriptor"* ]]; then echo "job_desc is not a JobDescriptor: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"name=attr,attr"* ]]; then echo "Attribute and item syntax differ: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"comment=by item"* ]]; then echo "Item assignment not visible as attribute: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"keys=True"* ]]; then echo "Mapping protocol incomplete: $MESSAGE"; exit 1; fi
@@ -0,0 +1,37 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit.py
+import enum
+import json
+import slurm
+class Level(enum.IntEnum):
+    HIGH = 3
+def job_submit(job_desc, submit_uid):
+    job_desc.comment = "audited"
+    slurm.user_msg("fields=%s" % slurm.to_json(job_desc, fields=["name", "comment"]))
+    slurm.user_msg("complete=%s" % (json.loads(slurm.to_json(job_desc))["name"] == job_desc.name))
+    removed = next(iter(job_desc.environment))
+    del job_desc.environment[removed]
+    environment = json.loads(slurm.to_json(job_desc, fields=["environment"]))["environment"]
+    slurm.user_msg("deleted=%s" % (removed not in environment and environment == dict(job_desc.environment)))
+    job_desc.environment["LEVEL"] = Level.HIGH
+    slurm.user_msg("level=%s" % json.loads(slurm.to_json(job_desc, fields=["environment"]))["environment"]["LEVEL"])
+    return 1
+EOF
+
+set +e
+MESSAGE=$(
+sbatch --job-name=json 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+scancel -u root
+
+if [[ $MESSAGE != *'fields={"name":"json","comment":"audited"}'* ]]; then echo "Selected fields not serialized: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"complete=True"* ]]; then echo "Descriptor not serialized: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"deleted=True"* ]]; then echo "Environment with a deleted key not serialized: $MESSAGE"; exit 1; fi
+if [[ $MESSAGE != *"level=3"* ]]; then echo "IntEnum not serialized as a number: $MESSAGE"; exit 1; fi
@@ -0,0 +1,33 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+rm -f /tmp/job_submit_python.audit*
+cat << EOF > /etc/slurm/job_submit_python.conf
+AuditLog=/tmp/job_submit_python.audit
+EOF
+supervisorctl restart slurmctld
+sleep 2
+
+cat << EOF > /etc/slurm/job_submit.py
+def job_submit(job_desc, submit_uid):
+    job_desc.comment = "audited"
+    return 0
+EOF
+
+sbatch --job-name=audit <<EOF
+#! /bin/bash
+hostname
+EOF
+sleep 2
+
+RECORDS=$(python3 tools/job_submit_audit.py /tmp/job_submit_python.audit)
+
+rm -f /etc/slurm/job_submit_python.conf
+supervisorctl restart slurmctld
+sleep 2
+
+scancel -u root
+
+if [[ $RECORDS != *'"name": "audit"'* ]]; then echo "Decision not recorded: $RECORDS"; exit 1; fi
+if [[ $RECORDS != *'"comment": {"old": null, "new": "audited"}'* ]]; then echo "Change not recorded: $RECORDS"; exit 1; fi
@@ -0,0 +1,51 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit_python.conf
+ShadowScript=job_submit_next
+EOF
+cat << EOF > /etc/slurm/job_submit_next.py
+def job_submit(job_desc, submit_uid):
+    job_desc.comment = "candidate"
+    return 0
+EOF
+supervisorctl restart slurmctld
+sleep 2
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    stats = slurm.stats()
+    slurm.user_msg("shadow=%d,%d" % (stats["shadow_evaluated"], stats["shadow_disagreed"]))
+    return 1 if job_desc.name == "report" else 0
+EOF
+
+sbatch --job-name=shadow <<EOF
+#! /bin/bash
+hostname
+EOF
+
+# The candidate runs in the background, so poll the counters until it did.
+# Each "report" probe is rejected by the live policy and accepted by the
+# candidate, so every evaluation disagrees.
+set +e
+for i in $(seq 1 30); do
+    MESSAGE=$(
+    sbatch --job-name=report 2>&1 <<EOF
+#! /bin/bash
+EOF
+    )
+    if [[ $MESSAGE =~ shadow=([0-9]+),([0-9]+) ]] && (( BASH_REMATCH[1] > 0 )); then break; fi
+    sleep 1
+done
+set -e
+
+rm -f /etc/slurm/job_submit_python.conf /etc/slurm/job_submit_next.py
+supervisorctl restart slurmctld
+sleep 2
+
+scancel -u root
+
+if [[ ! $MESSAGE =~ shadow=([0-9]+),([0-9]+) ]] || (( BASH_REMATCH[1] == 0 )); then echo "Shadow policy not evaluated: $MESSAGE"; exit 1; fi
+if (( BASH_REMATCH[2] != BASH_REMATCH[1] )); then echo "Shadow policy disagreement not counted: $MESSAGE"; exit 1; fi
@@ -0,0 +1,44 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit_python.conf
+PartitionScript=debug:job_submit_debug
+EOF
+cat << EOF > /etc/slurm/job_submit_debug.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("policy=debug")
+    return 1
+EOF
+supervisorctl restart slurmctld
+sleep 2
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("policy=default")
+    return 1
+EOF
+
+set +e
+ROUTED=$(
+sbatch --partition=debug 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+DEFAULT=$(
+sbatch 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+rm -f /etc/slurm/job_submit_python.conf /etc/slurm/job_submit_debug.py
+supervisorctl restart slurmctld
+sleep 2
+
+scancel -u root
+
+if [[ $ROUTED != *"policy=debug"* ]]; then echo "Partition not routed to its module: $ROUTED"; exit 1; fi
+if [[ $DEFAULT != *"policy=default"* ]]; then echo "Unrouted job not sent to job_submit.py: $DEFAULT"; exit 1; fi
@@ -0,0 +1,55 @@
+#!/bin/bash
+set -euo pipefail
+IFS=$'\n\t'
+
+cat << EOF > /etc/slurm/job_submit_python.conf
+DefaultScript=job_submit_first,job_submit,job_submit_last
+EOF
+cat << EOF > /etc/slurm/job_submit_first.py
+def job_submit(job_desc, submit_uid):
+    job_desc.comment = "first"
+    return 0
+EOF
+cat << EOF > /etc/slurm/job_submit_last.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("last stage ran")
+    return 1
+EOF
+supervisorctl restart slurmctld
+sleep 2
+
+cat << EOF > /etc/slurm/job_submit.py
+import slurm
+def job_submit(job_desc, submit_uid):
+    slurm.user_msg("comment=%s" % job_desc.comment)
+    slurm.user_msg("calls=%d" % slurm.stats()["stages"]["job_submit_first"]["calls"])
+    return slurm.STOP if job_desc.name == "stop" else 0
+EOF
+
+set +e
+REJECTED=$(
+sbatch --job-name=chain 2>&1 <<EOF
+#! /bin/bash
+EOF
+)
+set -e
+
+JID=$(
+sbatch --parsable --job-name=stop <<EOF
+#! /bin/bash
+hostname
+EOF
+)
+COMMENT=$(squeue --states all -j "$JID" --Format comment --noheader | xargs)
+
+rm -f /etc/slurm/job_submit_python.conf /etc/slurm/job_submit_first.py /etc/slurm/job_submit_last.py
+supervisorctl restart slurmctld
+sleep 2
+
+scancel -u root
+
+if [[ $REJECTED != *"comment=first"* ]]; then echo "Stage did not see the previous one's changes: $REJECTED"; exit 1; fi
+if [[ $REJECTED != *"calls=1"* ]]; then echo "Stage not counted: $REJECTED"; exit 1; fi
+if [[ $REJECTED != *"last stage ran"* ]]; then echo "Pipeline did not reach the last stage: $REJECTED"; exit 1; fi
+if [[ $COMMENT != "first" ]]; then echo "slurm.STOP did not accept the job as modified: \"$COMMENT\""; exit 1; fi
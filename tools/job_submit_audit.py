@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Print the records of job_submit/python audit logs as JSON lines.
+
+Usage: job_submit_audit.py [--changes-only] FILE...
+
+Rotated files (FILE.1, FILE.2, ...) are read like any other, list them
+oldest first to print the records in order.
+"""
+import json
+import struct
+import sys
+from datetime import datetime, timezone
+
+MAGIC = b"SLJSAUD1"
+HEADER = struct.Struct("<BQIiIBH")
+FLAG_SHED = 0x01
+FLAG_SHADOW = 0x02
+
+
+def read_value(record, offset, size):
+    (length,) = struct.unpack_from("<" + size, record, offset)
+    offset += struct.calcsize(size)
+    return record[offset:offset + length].decode("utf-8", "surrogateescape"), offset + length
+
+
+def decode(record):
+    version, time_us, uid, rc, latency_us, flags, entries = HEADER.unpack_from(record)
+    if version != 1:
+        raise ValueError(f"unsupported record version {version}")
+    out = {
+        "time": datetime.fromtimestamp(time_us / 1e6, timezone.utc).isoformat(),
+        "submit_uid": uid,
+        "rc": rc,
+        "latency_us": latency_us,
+        "shed": bool(flags & FLAG_SHED),
+        "shadow": bool(flags & FLAG_SHADOW),
+        "fields": {},
+        "changes": {},
+    }
+    offset = HEADER.size
+    for _ in range(entries):
+        kind = chr(record[offset])
+        name, offset = read_value(record, offset + 1, "H")
+        value, offset = read_value(record, offset, "I")
+        if kind == "c":
+            new, offset = read_value(record, offset, "I")
+            out["changes"][name] = {"old": json.loads(value), "new": json.loads(new)}
+        else:
+            out["fields"][name] = json.loads(value)
+    return out
+
+
+def read_file(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if not data.startswith(MAGIC):
+        raise ValueError(f"{path}: not a job_submit/python audit log")
+    offset = len(MAGIC)
+    while offset + 4 <= len(data):
+        (length,) = struct.unpack_from("<I", data, offset)
+        if offset + 4 + length > len(data):
+            break
+        yield decode(data[offset + 4:offset + 4 + length])
+        offset += 4 + length
+    if offset != len(data):
+        print(f"{path}: ignoring a truncated record at offset {offset}", file=sys.stderr)
+
+
+def main(argv):
+    changes_only = "--changes-only" in argv
+    paths = [arg for arg in argv if arg != "--changes-only"]
+    if not paths:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    for path in paths:
+        for record in read_file(path):
+            if changes_only and not record["changes"]:
+                continue
+            print(json.dumps(record))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))